@@ -28,8 +28,13 @@ common_drm_hwcomposer_cflags := \
 include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES := \
+	drmformattable.cpp \
+	drmuevent.cpp \
+	vsyncmodel.cpp \
 	worker.cpp
 
+LOCAL_SHARED_LIBRARIES := libdrm
+
 LOCAL_CFLAGS := $(common_drm_hwcomposer_cflags)
 
 LOCAL_MODULE := libdrmhwc_utils
@@ -60,6 +65,8 @@ LOCAL_C_INCLUDES := \
 
 LOCAL_SRC_FILES := \
 	autolock.cpp \
+	commitaggregator.cpp \
+	commitworker.cpp \
 	resourcemanager.cpp \
 	drmdevice.cpp \
 	drmconnector.cpp \
@@ -73,8 +80,9 @@ LOCAL_SRC_FILES := \
 	drmplane.cpp \
 	drmproperty.cpp \
 	hwcutils.cpp \
+	importworker.cpp \
 	platform.cpp \
-	vsyncworker.cpp
+	vblankdispatcher.cpp
 
 LOCAL_CFLAGS := $(common_drm_hwcomposer_cflags)
 
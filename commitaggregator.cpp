@@ -0,0 +1,245 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define ATRACE_TAG ATRACE_TAG_GRAPHICS
+#define LOG_TAG "hwc-commit-aggregator"
+
+#include "commitaggregator.h"
+#include "drmdevice.h"
+#include "drmeventlistener.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <map>
+#include <stdlib.h>
+#include <unistd.h>
+#include <xf86drm.h>
+
+#include <cutils/properties.h>
+#include <log/log.h>
+#include <utils/Trace.h>
+
+namespace android {
+
+// Hands the flip event of each crtc of a merged commit to the flip handler of
+// the display on that crtc
+class AggregateFlipHandler : public DrmEventHandler {
+ public:
+  ~AggregateFlipHandler() override {
+    for (auto &handler : handlers_)
+      delete handler.second;
+  }
+
+  void AddHandler(uint32_t crtc_id, DrmEventHandler *handler) {
+    handlers_[crtc_id] = handler;
+  }
+
+  // The commit failed, the handlers stay with their displays
+  void DropHandlers() {
+    handlers_.clear();
+  }
+
+  void HandleEvent(uint64_t /* timestamp_us */) override {
+  }
+
+  bool HandleCrtcEvent(uint32_t crtc_id, uint64_t timestamp_us) override {
+    auto it = handlers_.find(crtc_id);
+    if (it != handlers_.end()) {
+      DrmEventHandler *handler = it->second;
+      handlers_.erase(it);
+      if (handler->HandleCrtcEvent(crtc_id, timestamp_us))
+        delete handler;
+    }
+    return handlers_.empty();
+  }
+
+ private:
+  std::map<uint32_t, DrmEventHandler *> handlers_;
+};
+
+CommitAggregator::CommitAggregator(DrmDevice *drm)
+    : drm_(drm), enabled_(false), window_(0) {
+}
+
+void CommitAggregator::Init() {
+  char aggregate_prop[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.aggregate_commits", aggregate_prop, "0");
+  enabled_ = strtol(aggregate_prop, NULL, 10);
+
+  char window_prop[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.aggregate_window_us", window_prop, "2000");
+  window_ = std::chrono::microseconds(
+      std::max(strtol(window_prop, NULL, 10), 0L));
+}
+
+void CommitAggregator::SetPending(int display, bool pending) {
+  std::lock_guard<std::mutex> lock(lock_);
+  if (pending) {
+    pending_displays_.insert(display);
+  } else {
+    pending_displays_.erase(display);
+    // Nobody needs to wait for this display anymore
+    cond_.notify_all();
+  }
+}
+
+bool CommitAggregator::ReadyLocked() const {
+  // Displays with a request in flight won't make it into this commit either
+  return std::all_of(pending_displays_.begin(), pending_displays_.end(),
+                     [this](int display) {
+                       return std::any_of(queue_.begin(), queue_.end(),
+                                          [display](const Request *request) {
+                                            return request->display == display;
+                                          });
+                     });
+}
+
+int CommitAggregator::Commit(int display, uint32_t crtc_id,
+                             drmModeAtomicReqPtr pset, uint32_t flags,
+                             DrmEventHandler *flip_handler) {
+  ATRACE_CALL();
+  Request request;
+  request.display = display;
+  request.crtc_id = crtc_id;
+  request.pset = pset;
+  request.flags = flags;
+  request.flip_handler = flip_handler;
+
+  std::unique_lock<std::mutex> lock(lock_);
+  queue_.push_back(&request);
+  cond_.notify_all();
+
+  // Only commits of frames announced through SetPending() wait for others,
+  // anything else (e.g. a flattened scene) just takes along what is queued
+  auto deadline = std::chrono::steady_clock::now();
+  if (pending_displays_.count(display))
+    deadline += window_;
+  while (!request.done) {
+    if (request.taken) {
+      cond_.wait(lock);
+    } else if (ReadyLocked() ||
+               std::chrono::steady_clock::now() >= deadline) {
+      CommitQueuedLocked(&lock, flags);
+    } else {
+      cond_.wait_until(lock, deadline);
+    }
+  }
+
+  queue_.erase(std::find(queue_.begin(), queue_.end(), &request));
+  return request.ret;
+}
+
+void CommitAggregator::CommitQueuedLocked(std::unique_lock<std::mutex> *lock,
+                                          uint32_t flags) {
+  // Requests with other flags go out in a commit of their own
+  std::vector<Request *> batch;
+  for (Request *request : queue_) {
+    if (request->taken || request->flags != flags)
+      continue;
+    request->taken = true;
+    batch.push_back(request);
+  }
+
+  lock->unlock();
+  int ret = CommitBatch(batch);
+  lock->lock();
+
+  ++commits_;
+  if (batch.size() > 1) {
+    ++merged_commits_;
+    merged_frames_ += batch.size();
+  }
+  // A failed batch of several has been retried one by one
+  if (batch.size() == 1 || !ret) {
+    for (Request *request : batch)
+      request->ret = ret;
+  } else {
+    ++split_commits_;
+  }
+  for (Request *request : batch)
+    request->done = true;
+  cond_.notify_all();
+}
+
+int CommitAggregator::AtomicCommit(drmModeAtomicReqPtr pset, uint32_t flags,
+                                   void *user_data) {
+  int ret = drmModeAtomicCommit(drm_->fd(), pset, flags, user_data);
+  // A flip we don't track can still be in flight, back off and retry until
+  // it has landed
+  for (int waited_ms = 0; ret == -EBUSY && (flags & DRM_MODE_ATOMIC_NONBLOCK) &&
+                          waited_ms < kBusyTimeoutMs;
+       waited_ms += kBusyRetryMs) {
+    usleep(kBusyRetryMs * 1000);
+    ret = drmModeAtomicCommit(drm_->fd(), pset, flags, user_data);
+  }
+  return ret;
+}
+
+int CommitAggregator::CommitBatch(const std::vector<Request *> &batch) {
+  bool flip_event = batch.front()->flags & DRM_MODE_PAGE_FLIP_EVENT;
+  if (batch.size() == 1)
+    return AtomicCommit(batch.front()->pset, batch.front()->flags,
+                        flip_event ? (void *)batch.front()->flip_handler
+                                   : (void *)drm_);
+
+  int ret = -ENOMEM;
+  AggregateFlipHandler *flip_handler = NULL;
+  drmModeAtomicReqPtr merged = drmModeAtomicDuplicate(batch.front()->pset);
+  if (merged) {
+    ret = 0;
+    flip_handler = flip_event ? new AggregateFlipHandler() : NULL;
+    for (Request *request : batch) {
+      if (request != batch.front())
+        ret = drmModeAtomicMerge(merged, request->pset);
+      if (ret)
+        break;
+      if (flip_handler)
+        flip_handler->AddHandler(request->crtc_id, request->flip_handler);
+    }
+
+    if (!ret)
+      ret = AtomicCommit(merged, batch.front()->flags,
+                         flip_handler ? (void *)flip_handler : (void *)drm_);
+    drmModeAtomicFree(merged);
+    if (!ret)
+      return 0;
+  }
+
+  if (flip_handler) {
+    flip_handler->DropHandlers();
+    delete flip_handler;
+  }
+
+  ALOGW("Merged commit of %zu displays failed %d, committing them one by one",
+        batch.size(), ret);
+  for (Request *request : batch)
+    request->ret = AtomicCommit(request->pset, request->flags,
+                                flip_event ? (void *)request->flip_handler
+                                           : (void *)drm_);
+  return ret;
+}
+
+void CommitAggregator::Dump(std::ostringstream *out) {
+  if (!enabled_)
+    return;
+
+  std::lock_guard<std::mutex> lock(lock_);
+  *out << "--CommitAggregator: window=" << window_.count()
+       << "us commits=" << commits_ << " merged=" << merged_commits_
+       << " merged frames=" << merged_frames_ << " split=" << split_commits_
+       << "\n";
+}
+}
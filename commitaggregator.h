@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_COMMIT_AGGREGATOR_H_
+#define ANDROID_COMMIT_AGGREGATOR_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <stdint.h>
+#include <vector>
+#include <xf86drmMode.h>
+
+namespace android {
+
+class DrmDevice;
+class DrmEventHandler;
+
+// Merges the frame commits of the displays of a DrmDevice into a single
+// atomic commit.
+//
+// Displays with a frame on the way mark themselves pending. A frame commit
+// handed to Commit() waits until every other pending display has handed in
+// its own, or until the aggregation window runs out, and then the collected
+// requests go to the kernel as one. Each request carries the OUT_FENCE_PTR of
+// its own crtc, so every display still gets its own out fence, and with
+// DRM_MODE_PAGE_FLIP_EVENT the per crtc events are routed back to the flip
+// handler of the display that crtc belongs to. Should the driver reject the
+// merged request, each request is retried on its own so one display can't
+// take down the others.
+//
+// Only a pending display's own commit waits, blocking its caller for up to
+// the window. That is what commit workers do; commits of displays that aren't
+// pending go out right away along with whatever is queued.
+class CommitAggregator {
+ public:
+  CommitAggregator(DrmDevice *drm);
+
+  void Init();
+
+  bool enabled() const {
+    return enabled_;
+  }
+
+  // Marks display as having a frame on the way, which later commits of other
+  // displays will wait for
+  void SetPending(int display, bool pending);
+
+  // Commits pset, which programs crtc_id on behalf of display, with flags.
+  // If flags holds DRM_MODE_PAGE_FLIP_EVENT, flip_handler is handed the flip
+  // event of crtc_id and is owned by the event listener once this returns 0.
+  // Returns what drmModeAtomicCommit() would have for pset on its own.
+  int Commit(int display, uint32_t crtc_id, drmModeAtomicReqPtr pset,
+             uint32_t flags, DrmEventHandler *flip_handler);
+
+  void Dump(std::ostringstream *out);
+
+ private:
+  // How long to retry a non-blocking commit the kernel is too busy for
+  static const int kBusyTimeoutMs = 100;
+  static const int kBusyRetryMs = 2;
+
+  struct Request {
+    int display;
+    uint32_t crtc_id;
+    drmModeAtomicReqPtr pset;
+    uint32_t flags;
+    DrmEventHandler *flip_handler;
+    // Picked up by a commit
+    bool taken = false;
+    bool done = false;
+    int ret = 0;
+  };
+
+  bool ReadyLocked() const;
+  void CommitQueuedLocked(std::unique_lock<std::mutex> *lock, uint32_t flags);
+  int CommitBatch(const std::vector<Request *> &batch);
+  int AtomicCommit(drmModeAtomicReqPtr pset, uint32_t flags, void *user_data);
+
+  DrmDevice *drm_;
+  bool enabled_;
+  std::chrono::microseconds window_;
+
+  std::mutex lock_;
+  std::condition_variable cond_;
+  std::set<int> pending_displays_;
+  std::vector<Request *> queue_;
+
+  uint64_t commits_ = 0;
+  uint64_t merged_commits_ = 0;
+  uint64_t merged_frames_ = 0;
+  uint64_t split_commits_ = 0;
+};
+}
+
+#endif
@@ -0,0 +1,358 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define ATRACE_TAG ATRACE_TAG_GRAPHICS
+#define LOG_TAG "hwc-commit-worker"
+
+#include "commitworker.h"
+#include "drmdisplaycompositor.h"
+
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <cutils/properties.h>
+#include <hardware/hardware.h>
+#include <log/log.h>
+#include <sw_sync.h>
+#include <sync/sync.h>
+#include <utils/Trace.h>
+
+namespace android {
+
+static int64_t GetTimestampNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 * 1000 * 1000 + ts.tv_nsec;
+}
+
+class LateLatchVsyncCallback : public VsyncCallback {
+ public:
+  void Callback(int /* display */, int64_t /* timestamp */) {
+    // The dispatcher has already fed the timestamp to the vsync model
+  }
+};
+
+CommitWorker::CommitWorker()
+    : Worker("commit", HAL_PRIORITY_URGENT_DISPLAY),
+      compositor_(NULL),
+      dispatcher_(NULL),
+      aggregator_(NULL),
+      display_(-1),
+      enabled_(false),
+      drop_policy_(DropPolicy::kBlock),
+      late_latch_(false),
+      vsync_enabled_(true),
+      late_latch_margin_ns_(0) {
+}
+
+CommitWorker::~CommitWorker() {
+  Exit();
+
+  if (vsync_callback_)
+    dispatcher_->UnregisterCallback(vsync_callback_);
+  if (aggregator_)
+    aggregator_->SetPending(display_, false);
+
+  // Don't leave anyone waiting on frames that will never be committed
+  if (timeline_fd_.get() >= 0)
+    AdvanceTimelineLocked(timeline_point_);
+}
+
+int CommitWorker::Init(DrmDisplayCompositor *compositor,
+                       VBlankDispatcher *dispatcher,
+                       CommitAggregator *aggregator, int display) {
+  compositor_ = compositor;
+  dispatcher_ = dispatcher;
+  display_ = display;
+
+  char depth_prop[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.commit_queue_depth", depth_prop, "0");
+  int depth = strtol(depth_prop, NULL, 10);
+  if (depth <= 0)
+    return 0;
+
+  // Present and release fences of queued frames come from this timeline,
+  // without it SurfaceFlinger would reuse buffers that are yet to be committed
+  timeline_fd_.Set(sw_sync_timeline_create());
+  if (timeline_fd_.get() < 0) {
+    ALOGW("No sw_sync timeline, not queuing commits for display %d", display_);
+    return 0;
+  }
+
+  char drop_prop[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.commit_queue_drop", drop_prop, "block");
+  if (!strcmp(drop_prop, "oldest"))
+    drop_policy_ = DropPolicy::kDropOldest;
+  else if (strcmp(drop_prop, "block"))
+    ALOGW("Unknown commit queue drop policy %s, blocking instead", drop_prop);
+
+  char late_latch_prop[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.late_latch", late_latch_prop, "0");
+  late_latch_ = strtol(late_latch_prop, NULL, 10);
+  // A blocking commit only returns once the frame is on screen, which says
+  // nothing about how long it took to get the commit to the kernel
+  if (late_latch_ && !compositor_->nonblocking_commit()) {
+    ALOGW("Late latching needs hwc.drm.nonblocking_commit, disabling it");
+    late_latch_ = false;
+  }
+
+  if (late_latch_) {
+    char margin_prop[PROPERTY_VALUE_MAX];
+    property_get("hwc.drm.late_latch_margin_us", margin_prop, "1000");
+    late_latch_margin_ns_ = strtol(margin_prop, NULL, 10) * 1000;
+
+    commit_latencies_.reserve(kLatencySamples);
+    vsync_callback_ = std::make_shared<LateLatchVsyncCallback>();
+    dispatcher_->RegisterCallback(display_, vsync_callback_);
+    dispatcher_->VSyncControl(vsync_callback_, true);
+  }
+
+  aggregator_ = aggregator;
+  ring_.resize(depth);
+  enabled_ = true;
+  return InitWorker();
+}
+
+int CommitWorker::QueueComposition(
+    std::unique_ptr<DrmDisplayComposition> composition, int *present_fence) {
+  ATRACE_CALL();
+  *present_fence = -1;
+
+  Lock();
+  UniqueFd fence(sw_sync_fence_create(timeline_fd_.get(), "drm_commit",
+                                      timeline_point_ + 1));
+  if (fence.get() < 0) {
+    Unlock();
+    // A queued frame without a present fence would have its buffers reused
+    // before it's on screen, commit it right away instead
+    ALOGE("Failed to create present fence %d, committing directly",
+          fence.get());
+    Drain();
+    return compositor_->CommitComposition(std::move(composition),
+                                          present_fence);
+  }
+
+  while (count_ == ring_.size()) {
+    if (drop_policy_ == DropPolicy::kDropOldest) {
+      // The dropped frame's timeline point, and with it the present and
+      // release fences handed out for it, only signals once the timeline
+      // reaches the point of a later frame, i.e. once the frame replacing it
+      // has been committed and is on screen
+      ring_[head_].composition.reset();
+      head_ = (head_ + 1) % ring_.size();
+      --count_;
+      ++frames_dropped_;
+    } else if (WaitForSignalOrExitLocked() == -EINTR) {
+      Unlock();
+      return -EINTR;
+    }
+  }
+
+  QueuedFrame &frame = ring_[(head_ + count_) % ring_.size()];
+  frame.composition = std::move(composition);
+  frame.timeline_point = ++timeline_point_;
+  ++count_;
+  if (aggregator_)
+    aggregator_->SetPending(display_, true);
+  *present_fence = fence.Release();
+  Unlock();
+
+  Signal();
+  return 0;
+}
+
+void CommitWorker::Drain() {
+  if (!enabled_)
+    return;
+
+  Lock();
+  while (count_ || committing_) {
+    if (WaitForSignalOrExitLocked() == -EINTR)
+      break;
+  }
+  Unlock();
+}
+
+void CommitWorker::SetVsyncEnabled(bool enabled) {
+  if (!vsync_callback_)
+    return;
+
+  Lock();
+  vsync_enabled_ = enabled;
+  Unlock();
+  dispatcher_->VSyncControl(vsync_callback_, enabled);
+}
+
+void CommitWorker::WaitForAcquireFences(DrmDisplayComposition *composition) {
+  ATRACE_CALL();
+  for (DrmHwcLayer &layer : composition->layers()) {
+    int fence = layer.acquire_fence.get();
+    if (fence < 0)
+      continue;
+
+    int ret = sync_wait(fence, kAcquireWaitTimeoutMs);
+    if (ret)
+      ALOGW("Acquire fence %d wait failed %d, committing anyway", fence, ret);
+  }
+}
+
+void CommitWorker::AdvanceTimelineLocked(unsigned point) {
+  if (point <= signaled_point_)
+    return;
+
+  int ret = sw_sync_timeline_inc(timeline_fd_.get(), point - signaled_point_);
+  if (ret)
+    ALOGE("Failed to advance commit timeline %d", ret);
+  signaled_point_ = point;
+}
+
+void CommitWorker::AddCommitLatencyLocked(int64_t latency_ns) {
+  if (commit_latencies_.size() < kLatencySamples)
+    commit_latencies_.push_back(latency_ns);
+  else
+    commit_latencies_[latency_index_] = latency_ns;
+  latency_index_ = (latency_index_ + 1) % kLatencySamples;
+}
+
+int64_t CommitWorker::CommitLatencyLocked() const {
+  if (commit_latencies_.size() < kMinLatencySamples)
+    return kDefaultLatencyNs;
+
+  std::vector<int64_t> sorted(commit_latencies_);
+  size_t p99 = (sorted.size() * 99 + 99) / 100 - 1;
+  std::nth_element(sorted.begin(), sorted.begin() + p99, sorted.end());
+  return sorted[p99];
+}
+
+int64_t CommitWorker::WaitForLatchDeadline(int *ret) {
+  *ret = 0;
+  // With a variable refresh rate the frame goes out as soon as it's
+  // committed, there is no vsync to wait for
+  if (!late_latch_ || dispatcher_->VariableRefresh(display_))
+    return -1;
+
+  Lock();
+  // Without vblanks the vsync model has nothing to go on
+  if (!vsync_enabled_) {
+    Unlock();
+    return -1;
+  }
+  int64_t lead_ns = CommitLatencyLocked() + late_latch_margin_ns_;
+  Unlock();
+
+  // Aim for the first vsync there is still time to make
+  int64_t target = dispatcher_->PredictNextVsync(display_,
+                                                 GetTimestampNs() + lead_ns);
+  int64_t deadline = target - lead_ns;
+
+  ATRACE_NAME("late latch");
+  Lock();
+  for (int64_t now = GetTimestampNs(); now < deadline;
+       now = GetTimestampNs()) {
+    if (WaitForSignalOrExitLocked(deadline - now) == -EINTR) {
+      *ret = -EINTR;
+      break;
+    }
+  }
+  Unlock();
+  return target;
+}
+
+void CommitWorker::Dump(std::ostringstream *out) {
+  Lock();
+  *out << "--CommitWorker[" << display_ << "]: enabled=" << enabled_
+       << " depth=" << ring_.size() << " policy="
+       << (drop_policy_ == DropPolicy::kBlock ? "block" : "oldest")
+       << " queued=" << count_ << " committed=" << frames_committed_
+       << " dropped=" << frames_dropped_ << " failed=" << frames_failed_
+       << "\n";
+  if (late_latch_)
+    *out << "----late latch: margin=" << late_latch_margin_ns_ / 1000
+         << "us p99 commit latency=" << CommitLatencyLocked() / 1000
+         << "us missed deadlines=" << deadlines_missed_ << "\n";
+  Unlock();
+}
+
+void CommitWorker::Routine() {
+  Lock();
+  if (!count_) {
+    int ret = WaitForSignalOrExitLocked();
+    if (ret == -EINTR || !count_) {
+      Unlock();
+      return;
+    }
+  }
+
+  QueuedFrame frame = std::move(ring_[head_]);
+  head_ = (head_ + 1) % ring_.size();
+  --count_;
+  committing_ = true;
+  Unlock();
+
+  // Wake up present if it's waiting for a free slot
+  Signal();
+
+  int ret;
+  int64_t target_vsync = WaitForLatchDeadline(&ret);
+  // Still commit when exiting, the frame's present fence is already out there
+  if (ret)
+    target_vsync = -1;
+
+  WaitForAcquireFences(frame.composition.get());
+
+  int out_fence = -1;
+  int64_t commit_start = GetTimestampNs();
+  ret = compositor_->CommitComposition(std::move(frame.composition),
+                                       &out_fence);
+  int64_t commit_latency = GetTimestampNs() - commit_start;
+  if (ret)
+    ALOGE("Failed to commit queued frame on display %d %d", display_, ret);
+
+  UniqueFd out_fence_fd(out_fence);
+  bool presented = out_fence_fd.get() >= 0;
+  if (presented && sync_wait(out_fence_fd.get(), kOutFenceTimeoutMs)) {
+    ALOGW("Timed out waiting for commit out fence on display %d", display_);
+    presented = false;
+  }
+  int64_t present_time = GetTimestampNs();
+  int64_t period = target_vsync >= 0 ? dispatcher_->PeriodNs(display_) : 0;
+
+  Lock();
+  if (ret)
+    ++frames_failed_;
+  else
+    ++frames_committed_;
+  if (!ret && target_vsync >= 0) {
+    AddCommitLatencyLocked(commit_latency);
+    // The out fence signals on the vblank the frame went out on, anything
+    // more than half a period after the target is a later one
+    if (presented && present_time > target_vsync + period / 2)
+      ++deadlines_missed_;
+  }
+  // Signals this frame's point along with those of the frames dropped before
+  // it, never ahead of a frame that is yet to be committed
+  AdvanceTimelineLocked(frame.timeline_point);
+  committing_ = false;
+  if (aggregator_ && !count_)
+    aggregator_->SetPending(display_, false);
+  Unlock();
+
+  // Wake up anyone draining the queue
+  Signal();
+}
+}
@@ -0,0 +1,154 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_COMMIT_WORKER_H_
+#define ANDROID_COMMIT_WORKER_H_
+
+#include "autofd.h"
+#include "commitaggregator.h"
+#include "drmdisplaycomposition.h"
+#include "vblankdispatcher.h"
+#include "worker.h"
+
+#include <memory>
+#include <sstream>
+#include <stdint.h>
+#include <vector>
+
+namespace android {
+
+class DrmDisplayCompositor;
+class VBlankDispatcher;
+
+// Commits frame compositions on behalf of SurfaceFlinger, so that present
+// only has to queue the finished composition instead of waiting on acquire
+// fences and the kernel.
+//
+// Frames are handed over through a fixed size ring with a single producer
+// (present) and a single consumer (the worker). Each queued frame gets a
+// present fence from a sw_sync timeline which is advanced once the frame's
+// commit has been published, or once a later frame has been if it got dropped.
+// Queuing stays disabled on kernels without sw_sync, and a frame no present
+// fence can be created for is committed right away.
+//
+// With late latching enabled, a frame is held until just before the vsync it
+// can still make, as predicted by the display's vsync model, minus the 99th
+// percentile of recent commit latencies and a safety margin. Only then are its
+// acquire fences waited on and the commit issued, so that the frame shows the
+// freshest content it can without missing that vsync.
+//
+// With commit aggregation, the worker keeps the display marked pending with
+// the device's CommitAggregator for as long as it holds frames, so that the
+// commits of other displays wait for this display's next one.
+class CommitWorker : public Worker {
+ public:
+  enum class DropPolicy {
+    // Make present wait for a free slot
+    kBlock,
+    // Replace the oldest frame that hasn't been committed yet
+    kDropOldest,
+  };
+
+  CommitWorker();
+  ~CommitWorker() override;
+
+  // aggregator may be NULL if commits aren't aggregated
+  int Init(DrmDisplayCompositor *compositor, VBlankDispatcher *dispatcher,
+           CommitAggregator *aggregator, int display);
+
+  bool enabled() const {
+    return enabled_;
+  }
+
+  // Queues composition for commit. On success *present_fence holds a fence
+  // that signals once the frame has been published. If no fence could be
+  // created, the frame is committed before returning like
+  // DrmDisplayCompositor::CommitComposition() does.
+  int QueueComposition(std::unique_ptr<DrmDisplayComposition> composition,
+                       int *present_fence);
+
+  // Waits until every queued frame has been committed
+  void Drain();
+
+  // Late latching keeps the display's vblanks flowing, which a dozing
+  // display can do without. Frames queued meanwhile go out right away.
+  void SetVsyncEnabled(bool enabled);
+
+  void Dump(std::ostringstream *out);
+
+ protected:
+  void Routine() override;
+
+ private:
+  // How long to wait on a single acquire fence before committing anyway
+  static const int kAcquireWaitTimeoutMs = 100;
+  // How long to wait for a commit's out fence before publishing the frame
+  static const int kOutFenceTimeoutMs = 1000;
+  // Number of recent commit latencies the late latch deadline is based on
+  static const size_t kLatencySamples = 128;
+  // Until this many latencies have been measured, assume kDefaultLatencyNs
+  static const size_t kMinLatencySamples = 8;
+  static const int64_t kDefaultLatencyNs = 4000000;
+
+  struct QueuedFrame {
+    std::unique_ptr<DrmDisplayComposition> composition;
+    unsigned timeline_point = 0;
+  };
+
+  void WaitForAcquireFences(DrmDisplayComposition *composition);
+  void AdvanceTimelineLocked(unsigned point);
+
+  // Sleeps until the late latch deadline for the next vsync that can still be
+  // made and returns that vsync's predicted time, or -1 if late latching is
+  // off, the display is dozing or runs at a variable refresh rate. Returns
+  // -EINTR through *ret if the worker is exiting.
+  int64_t WaitForLatchDeadline(int *ret);
+  void AddCommitLatencyLocked(int64_t latency_ns);
+  int64_t CommitLatencyLocked() const;
+
+  DrmDisplayCompositor *compositor_;
+  VBlankDispatcher *dispatcher_;
+  CommitAggregator *aggregator_;
+  int display_;
+  bool enabled_;
+  DropPolicy drop_policy_;
+
+  bool late_latch_;
+  bool vsync_enabled_;
+  int64_t late_latch_margin_ns_;
+  // Keeps vblank events, and with them the vsync model, flowing while late
+  // latching
+  std::shared_ptr<VsyncCallback> vsync_callback_;
+  std::vector<int64_t> commit_latencies_;
+  size_t latency_index_ = 0;
+
+  std::vector<QueuedFrame> ring_;
+  size_t head_ = 0;
+  size_t count_ = 0;
+  bool committing_ = false;
+
+  UniqueFd timeline_fd_;
+  unsigned timeline_point_ = 0;
+  unsigned signaled_point_ = 0;
+
+  uint64_t frames_committed_ = 0;
+  uint64_t frames_dropped_ = 0;
+  uint64_t frames_failed_ = 0;
+  uint64_t deadlines_missed_ = 0;
+};
+}
+
+#endif
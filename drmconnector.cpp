@@ -19,14 +19,70 @@
 #include "drmconnector.h"
 #include "drmdevice.h"
 
+#include <algorithm>
 #include <errno.h>
 #include <stdint.h>
+#include <string.h>
 
 #include <log/log.h>
 #include <xf86drmMode.h>
 
 namespace android {
 
+static const uint64_t kFnvOffsetBasis = 0xcbf29ce484222325ULL;
+static const uint64_t kFnvPrime = 0x100000001b3ULL;
+
+static uint64_t HashBytes(uint64_t hash, const void *data, size_t size) {
+  const uint8_t *bytes = (const uint8_t *)data;
+  for (size_t i = 0; i < size; ++i)
+    hash = (hash ^ bytes[i]) * kFnvPrime;
+  return hash;
+}
+
+static uint64_t HashValue(uint64_t hash, uint32_t value) {
+  return HashBytes(hash, &value, sizeof(value));
+}
+
+// Hashes the fields DrmMode::operator== compares
+static uint64_t HashModeTimings(const drmModeModeInfo &m) {
+  uint64_t hash = kFnvOffsetBasis;
+  for (uint32_t value : {m.clock, (uint32_t)m.hdisplay, (uint32_t)m.hsync_start,
+                         (uint32_t)m.hsync_end, (uint32_t)m.htotal,
+                         (uint32_t)m.hskew, (uint32_t)m.vdisplay,
+                         (uint32_t)m.vsync_start, (uint32_t)m.vsync_end,
+                         (uint32_t)m.vtotal, (uint32_t)m.vscan, m.flags,
+                         m.type})
+    hash = HashValue(hash, value);
+  return hash;
+}
+
+// Picks the vertical refresh range out of the display range limits descriptor
+// of the EDID base block, if there is one
+static bool ParseEdidRefreshRange(const uint8_t *edid, size_t size,
+                                  float *min_hz, float *max_hz) {
+  static const size_t kBaseBlockSize = 128;
+  static const size_t kDescriptorSize = 18;
+  if (size < kBaseBlockSize)
+    return false;
+
+  for (size_t offset = 54; offset + kDescriptorSize <= 126;
+       offset += kDescriptorSize) {
+    const uint8_t *d = edid + offset;
+    if (d[0] || d[1] || d[2] || d[3] != 0xfd)
+      continue;
+
+    // EDID 1.4 flags 255Hz offsets for rates that don't fit a byte
+    int min = d[5] + ((d[4] & 0x3) == 0x3 ? 255 : 0);
+    int max = d[6] + ((d[4] & 0x2) ? 255 : 0);
+    if (!min || max <= min)
+      return false;
+    *min_hz = min;
+    *max_hz = max;
+    return true;
+  }
+  return false;
+}
+
 DrmConnector::DrmConnector(DrmDevice *drm, drmModeConnectorPtr c,
                            DrmEncoder *current_encoder,
                            std::vector<DrmEncoder *> &possible_encoders)
@@ -41,6 +97,11 @@ DrmConnector::DrmConnector(DrmDevice *drm, drmModeConnectorPtr c,
       possible_encoders_(possible_encoders) {
 }
 
+DrmConnector::~DrmConnector() {
+  for (auto &blob : mode_blobs_)
+    drm_->DestroyPropertyBlob(blob.second.blob_id);
+}
+
 int DrmConnector::Init() {
   int ret = drm_->GetConnectorProperty(*this, "DPMS", &dpms_property_);
   if (ret) {
@@ -52,6 +113,8 @@ int DrmConnector::Init() {
     ALOGE("Could not get CRTC_ID property\n");
     return ret;
   }
+  // Optional, connectors without a sink to probe don't have one
+  drm_->GetConnectorProperty(*this, "EDID", &edid_property_);
   if (writeback()) {
     ret = drm_->GetConnectorProperty(*this, "WRITEBACK_PIXEL_FORMATS",
                                      &writeback_pixel_formats_);
@@ -110,44 +173,187 @@ bool DrmConnector::valid_type() const {
   return internal() || external() || writeback();
 }
 
-int DrmConnector::UpdateModes() {
+uint64_t DrmConnector::UpdateEdid(drmModeConnectorPtr c) {
+  min_refresh_hz_ = max_refresh_hz_ = 0.0f;
+
+  uint32_t edid_property_id = edid_property_.id();
+  if (!edid_property_id)
+    return 0;
+
+  uint32_t blob_id = 0;
+  for (int i = 0; i < c->count_props; ++i) {
+    if (c->props[i] == edid_property_id) {
+      blob_id = c->prop_values[i];
+      break;
+    }
+  }
+  if (!blob_id)
+    return 0;
+
+  // Blob ids get recycled, only the contents say whether the sink changed
+  drmModePropertyBlobPtr blob = drmModeGetPropertyBlob(drm_->fd(), blob_id);
+  if (!blob)
+    return 0;
+  uint64_t hash = HashBytes(kFnvOffsetBasis, blob->data, blob->length);
+  ParseEdidRefreshRange((const uint8_t *)blob->data, blob->length,
+                        &min_refresh_hz_, &max_refresh_hz_);
+  drmModeFreePropertyBlob(blob);
+  return hash;
+}
+
+uint32_t DrmConnector::ModeId(drmModeModeInfoPtr mode) {
+  uint64_t hash = HashModeTimings(*mode);
+  auto range = known_modes_.equal_range(hash);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (it->second == *mode)
+      return it->second.id();
+  }
+
+  DrmMode m(mode);
+  m.set_id(drm_->next_mode_id());
+  known_modes_.emplace(hash, m);
+  return m.id();
+}
+
+int DrmConnector::UpdateModes(bool probe) {
   int fd = drm_->fd();
 
-  drmModeConnectorPtr c = drmModeGetConnector(fd, id_);
+  drmModeConnectorPtr c;
+  if (probe || !modes_probed_)
+    c = drmModeGetConnector(fd, id_);
+  else
+    c = drmModeGetConnectorCurrent(fd, id_);
   if (!c) {
     ALOGE("Failed to get connector %d", id_);
     return -ENODEV;
   }
+  modes_probed_ = true;
 
   state_ = c->connection;
 
+  uint64_t edid_hash = UpdateEdid(c);
+  uint64_t hash = HashValue(kFnvOffsetBasis, c->connection);
+  hash = HashBytes(hash, &edid_hash, sizeof(edid_hash));
+  hash = HashBytes(hash, c->modes, c->count_modes * sizeof(*c->modes));
+  if (hash == modes_hash_ && !modes_.empty()) {
+    drmModeFreeConnector(c);
+    return 0;
+  }
+  modes_hash_ = hash;
+
   std::vector<DrmMode> new_modes;
   for (int i = 0; i < c->count_modes; ++i) {
-    bool exists = false;
-    for (const DrmMode &mode : modes_) {
-      if (mode == c->modes[i]) {
-        new_modes.push_back(mode);
-        exists = true;
-        break;
-      }
-    }
-    if (exists)
-      continue;
-
     DrmMode m(&c->modes[i]);
-    m.set_id(drm_->next_mode_id());
+    m.set_id(ModeId(&c->modes[i]));
     new_modes.push_back(m);
   }
   modes_.swap(new_modes);
+  drmModeFreeConnector(c);
+
+  ReleaseStaleModeBlobs();
   return 0;
 }
 
+int DrmConnector::GetModeBlob(const DrmMode &mode, uint32_t *blob_id) {
+  std::lock_guard<std::mutex> lock(mode_blobs_lock_);
+  auto blob = mode_blobs_.find(mode.id());
+  if (blob != mode_blobs_.end()) {
+    *blob_id = blob->second.blob_id;
+    ++blob->second.refs;
+    // The mode is back in the mode list
+    blob->second.stale = false;
+    return 0;
+  }
+
+  struct drm_mode_modeinfo drm_mode;
+  memset(&drm_mode, 0, sizeof(drm_mode));
+  mode.ToDrmModeModeInfo(&drm_mode);
+  int ret = drm_->CreatePropertyBlob(&drm_mode, sizeof(drm_mode), blob_id);
+  if (ret) {
+    ALOGE("Failed to create mode property blob %d", ret);
+    return ret;
+  }
+
+  mode_blobs_[mode.id()] = ModeBlob{*blob_id, 1, false};
+  return 0;
+}
+
+void DrmConnector::PutModeBlob(uint32_t blob_id) {
+  std::lock_guard<std::mutex> lock(mode_blobs_lock_);
+  auto blob = std::find_if(mode_blobs_.begin(), mode_blobs_.end(),
+                           [blob_id](const std::pair<const uint32_t,
+                                                     ModeBlob> &b) {
+                             return b.second.blob_id == blob_id;
+                           });
+  if (blob == mode_blobs_.end() || !blob->second.refs) {
+    ALOGE("Unbalanced put of mode blob %u", blob_id);
+    return;
+  }
+
+  if (--blob->second.refs || !blob->second.stale)
+    return;
+
+  drm_->DestroyPropertyBlob(blob->second.blob_id);
+  mode_blobs_.erase(blob);
+}
+
+void DrmConnector::ReleaseStaleModeBlobs() {
+  std::lock_guard<std::mutex> lock(mode_blobs_lock_);
+  for (auto blob = mode_blobs_.begin(); blob != mode_blobs_.end();) {
+    uint32_t mode_id = blob->first;
+    bool listed = std::any_of(modes_.begin(), modes_.end(),
+                              [mode_id](const DrmMode &mode) {
+                                return mode.id() == mode_id;
+                              });
+    blob->second.stale = !listed;
+    // A blob still borrowed, e.g. for a modeset yet to be committed, goes
+    // with its last PutModeBlob()
+    if (listed || blob->second.refs) {
+      ++blob;
+      continue;
+    }
+
+    // The kernel keeps its own reference while the mode is in use by a crtc
+    drm_->DestroyPropertyBlob(blob->second.blob_id);
+    blob = mode_blobs_.erase(blob);
+  }
+}
+
 const DrmMode &DrmConnector::active_mode() const {
   return active_mode_;
 }
 
 void DrmConnector::set_active_mode(const DrmMode &mode) {
+  std::lock_guard<std::mutex> lock(scanout_mode_lock_);
   active_mode_ = mode;
+  scanout_mode_ = DrmMode();
+}
+
+DrmMode DrmConnector::scanout_mode() const {
+  std::lock_guard<std::mutex> lock(scanout_mode_lock_);
+  return scanout_mode_.id() ? scanout_mode_ : active_mode_;
+}
+
+void DrmConnector::set_scanout_mode(const DrmMode &mode) {
+  std::lock_guard<std::mutex> lock(scanout_mode_lock_);
+  scanout_mode_ = mode;
+}
+
+bool DrmConnector::vrr_capable() {
+  DrmProperty vrr_capable;
+  uint64_t value = 0;
+  if (drm_->GetConnectorProperty(*this, "vrr_capable", &vrr_capable) ||
+      vrr_capable.value(&value))
+    return false;
+  return value != 0;
+}
+
+bool DrmConnector::GetRefreshRange(float *min_hz, float *max_hz) const {
+  if (max_refresh_hz_ <= 0.0f)
+    return false;
+  *min_hz = min_refresh_hz_;
+  *max_hz = max_refresh_hz_;
+  return true;
 }
 
 const DrmProperty &DrmConnector::dpms_property() const {
@@ -21,7 +21,10 @@
 #include "drmmode.h"
 #include "drmproperty.h"
 
+#include <map>
+#include <mutex>
 #include <stdint.h>
+#include <unordered_map>
 #include <vector>
 #include <xf86drmMode.h>
 
@@ -36,6 +39,7 @@ class DrmConnector {
                std::vector<DrmEncoder *> &possible_encoders);
   DrmConnector(const DrmProperty &) = delete;
   DrmConnector &operator=(const DrmProperty &) = delete;
+  ~DrmConnector();
 
   int Init();
 
@@ -49,7 +53,12 @@ class DrmConnector {
   bool writeback() const;
   bool valid_type() const;
 
-  int UpdateModes();
+  // Refreshes the connection state and mode list. The sink is only probed
+  // (reading its EDID over DDC) on the first call or when probe is set,
+  // otherwise the kernel's current view is used. The mode list is rebuilt
+  // only if the connection, the EDID or the kernel's modes changed, and a
+  // mode keeps its id for as long as the connector is around.
+  int UpdateModes(bool probe = false);
 
   const std::vector<DrmMode> &modes() const {
     return modes_;
@@ -57,6 +66,35 @@ class DrmConnector {
   const DrmMode &active_mode() const;
   void set_active_mode(const DrmMode &mode);
 
+  // The mode the crtc actually scans out. Only differs from active_mode()
+  // while the compositor has dropped to a lower refresh rate on an idle
+  // scene; setting the active mode, or an empty DrmMode, ends that. Set from
+  // the compositor's threads and read from the vblank dispatcher, hence the
+  // copy.
+  DrmMode scanout_mode() const;
+  void set_scanout_mode(const DrmMode &mode);
+
+  // Whether the sink can do variable refresh rate, as of the last property
+  // refresh
+  bool vrr_capable();
+  // The vertical refresh range the sink's EDID advertises. Returns false if
+  // it doesn't advertise one.
+  bool GetRefreshRange(float *min_hz, float *max_hz) const;
+  // Set by the compositor once it has committed VRR_ENABLED
+  bool vrr_active() const {
+    return vrr_active_;
+  }
+  void set_vrr_active(bool active) {
+    vrr_active_ = active;
+  }
+
+  // Returns the MODE_ID property blob for mode, which must be one of modes().
+  // Blobs are created on first use and owned by the connector, which keeps
+  // them until their mode drops out of the mode list and every reference
+  // taken by GetModeBlob() has been dropped with PutModeBlob().
+  int GetModeBlob(const DrmMode &mode, uint32_t *blob_id);
+  void PutModeBlob(uint32_t blob_id);
+
   const DrmProperty &dpms_property() const;
   const DrmProperty &crtc_id_property() const;
   const DrmProperty &writeback_pixel_formats() const;
@@ -87,11 +125,39 @@ class DrmConnector {
   uint32_t mm_width_;
   uint32_t mm_height_;
 
+  uint64_t UpdateEdid(drmModeConnectorPtr c);
+  uint32_t ModeId(drmModeModeInfoPtr mode);
+  void ReleaseStaleModeBlobs();
+
   DrmMode active_mode_;
+  // Guards scanout_mode_, and active_mode_ against set_active_mode()
+  mutable std::mutex scanout_mode_lock_;
+  DrmMode scanout_mode_;
+
+  // From the EDID display range limits, 0 if unknown
+  float min_refresh_hz_ = 0.0f;
+  float max_refresh_hz_ = 0.0f;
+  bool vrr_active_ = false;
   std::vector<DrmMode> modes_;
+  bool modes_probed_ = false;
+  // Hash of the connection, EDID and kernel mode list modes_ was built from
+  uint64_t modes_hash_ = 0;
+  // Every mode seen on the connector, by hash of its timings
+  std::unordered_multimap<uint64_t, DrmMode> known_modes_;
+
+  struct ModeBlob {
+    uint32_t blob_id;
+    unsigned refs;
+    // The mode dropped out of the mode list
+    bool stale;
+  };
+  // MODE_ID blobs by mode id
+  std::mutex mode_blobs_lock_;
+  std::map<uint32_t, ModeBlob> mode_blobs_;
 
   DrmProperty dpms_property_;
   DrmProperty crtc_id_property_;
+  DrmProperty edid_property_;
   DrmProperty writeback_pixel_formats_;
   DrmProperty writeback_fb_id_;
   DrmProperty writeback_out_fence_;
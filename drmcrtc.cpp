@@ -48,6 +48,9 @@ int DrmCrtc::Init() {
     ALOGE("Failed to get OUT_FENCE_PTR property");
     return ret;
   }
+
+  // Optional
+  drm_->GetCrtcProperty(*this, "VRR_ENABLED", &vrr_enabled_property_);
   return 0;
 }
 
@@ -82,4 +85,8 @@ const DrmProperty &DrmCrtc::mode_property() const {
 const DrmProperty &DrmCrtc::out_fence_ptr_property() const {
   return out_fence_ptr_property_;
 }
+
+const DrmProperty &DrmCrtc::vrr_enabled_property() const {
+  return vrr_enabled_property_;
+}
 }
@@ -46,6 +46,8 @@ class DrmCrtc {
   const DrmProperty &active_property() const;
   const DrmProperty &mode_property() const;
   const DrmProperty &out_fence_ptr_property() const;
+  // Has id 0 if the driver doesn't do variable refresh rate
+  const DrmProperty &vrr_enabled_property() const;
 
  private:
   DrmDevice *drm_;
@@ -59,6 +61,7 @@ class DrmCrtc {
   DrmProperty active_property_;
   DrmProperty mode_property_;
   DrmProperty out_fence_ptr_property_;
+  DrmProperty vrr_enabled_property_;
 };
 }
 
@@ -23,10 +23,13 @@
 #include "drmplane.h"
 #include "drmdevice.h"
 
+#include <algorithm>
 #include <cinttypes>
+#include <drm/drm_fourcc.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdint.h>
+#include <sys/stat.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
@@ -35,31 +38,30 @@
 
 namespace android {
 
-DrmDevice::DrmDevice() : event_listener_(this) {
+DrmDevice::DrmDevice() : vblank_dispatcher_(this), commit_aggregator_(this) {
 }
 
 DrmDevice::~DrmDevice() {
-  event_listener_.Exit();
 }
 
-std::tuple<int, int> DrmDevice::Init(const char *path, int num_displays) {
+int DrmDevice::Init(const char *path) {
   /* TODO: Use drmOpenControl here instead */
   fd_.Set(open(path, O_RDWR));
   if (fd() < 0) {
     ALOGE("Failed to open dri- %s", strerror(-errno));
-    return std::make_tuple(-ENODEV, 0);
+    return -ENODEV;
   }
 
   int ret = drmSetClientCap(fd(), DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1);
   if (ret) {
     ALOGE("Failed to set universal plane cap %d", ret);
-    return std::make_tuple(ret, 0);
+    return ret;
   }
 
   ret = drmSetClientCap(fd(), DRM_CLIENT_CAP_ATOMIC, 1);
   if (ret) {
     ALOGE("Failed to set atomic cap %d", ret);
-    return std::make_tuple(ret, 0);
+    return ret;
   }
 
 #ifdef DRM_CLIENT_CAP_WRITEBACK_CONNECTORS
@@ -70,10 +72,16 @@ std::tuple<int, int> DrmDevice::Init(const char *path, int num_displays) {
   }
 #endif
 
+  uint64_t cap_value = 0;
+  if (!drmGetCap(fd(), DRM_CAP_ADDFB2_MODIFIERS, &cap_value) && cap_value)
+    supports_fb_modifiers_ = true;
+  else
+    ALOGI("Framebuffer modifiers are not supported");
+
   drmModeResPtr res = drmModeGetResources(fd());
   if (!res) {
     ALOGE("Failed to get DrmDevice resources");
-    return std::make_tuple(-ENODEV, 0);
+    return -ENODEV;
   }
 
   min_resolution_ =
@@ -81,10 +89,6 @@ std::tuple<int, int> DrmDevice::Init(const char *path, int num_displays) {
   max_resolution_ =
       std::pair<uint32_t, uint32_t>(res->max_width, res->max_height);
 
-  // Assumes that the primary display will always be in the first
-  // drm_device opened.
-  bool found_primary = num_displays != 0;
-
   for (int i = 0; !ret && i < res->count_crtcs; ++i) {
     drmModeCrtcPtr c = drmModeGetCrtc(fd(), res->crtcs[i]);
     if (!c) {
@@ -173,45 +177,17 @@ std::tuple<int, int> DrmDevice::Init(const char *path, int num_displays) {
       connectors_.emplace_back(std::move(conn));
   }
 
-  // First look for primary amongst internal connectors
-  for (auto &conn : connectors_) {
-    if (conn->internal() && !found_primary) {
-      conn->set_display(num_displays);
-      displays_[num_displays] = num_displays;
-      ++num_displays;
-      found_primary = true;
-      break;
-    }
-  }
-
-  // Then pick first available as primary and for the others assign
-  // consecutive display_numbers.
-  for (auto &conn : connectors_) {
-    if (conn->external() || conn->internal()) {
-      if (!found_primary) {
-        conn->set_display(num_displays);
-        displays_[num_displays] = num_displays;
-        found_primary = true;
-        ++num_displays;
-      } else if (conn->display() < 0) {
-        conn->set_display(num_displays);
-        displays_[num_displays] = num_displays;
-        ++num_displays;
-      }
-    }
-  }
-
   if (res)
     drmModeFreeResources(res);
 
   // Catch-all for the above loops
   if (ret)
-    return std::make_tuple(ret, 0);
+    return ret;
 
   drmModePlaneResPtr plane_res = drmModeGetPlaneResources(fd());
   if (!plane_res) {
     ALOGE("Failed to get plane resources");
-    return std::make_tuple(-ENOENT, 0);
+    return -ENOENT;
   }
 
   for (uint32_t i = 0; i < plane_res->count_planes; ++i) {
@@ -235,14 +211,48 @@ std::tuple<int, int> DrmDevice::Init(const char *path, int num_displays) {
     planes_.emplace_back(std::move(plane));
   }
   drmModeFreePlaneResources(plane_res);
-  if (ret)
-    return std::make_tuple(ret, 0);
+  return ret;
+}
+
+std::tuple<int, int> DrmDevice::AssignDisplays(int num_displays) {
+  // Assumes that the primary display will always be in the first
+  // drm_device opened.
+  bool found_primary = num_displays != 0;
+
+  // First look for primary amongst internal connectors
+  for (auto &conn : connectors_) {
+    if (conn->internal() && !found_primary) {
+      conn->set_display(num_displays);
+      displays_[num_displays] = num_displays;
+      ++num_displays;
+      found_primary = true;
+      break;
+    }
+  }
+
+  // Then pick first available as primary and for the others assign
+  // consecutive display_numbers.
+  for (auto &conn : connectors_) {
+    if (conn->external() || conn->internal()) {
+      if (!found_primary) {
+        conn->set_display(num_displays);
+        displays_[num_displays] = num_displays;
+        found_primary = true;
+        ++num_displays;
+      } else if (conn->display() < 0) {
+        conn->set_display(num_displays);
+        displays_[num_displays] = num_displays;
+        ++num_displays;
+      }
+    }
+  }
 
-  ret = event_listener_.Init();
+  int ret = vblank_dispatcher_.Init();
   if (ret) {
-    ALOGE("Can't initialize event listener %d", ret);
+    ALOGE("Can't initialize vblank dispatcher %d", ret);
     return std::make_tuple(ret, 0);
   }
+  commit_aggregator_.Init();
 
   for (auto &conn : connectors_) {
     ret = CreateDisplayPipe(conn.get());
@@ -439,12 +449,121 @@ int DrmDevice::DestroyPropertyBlob(uint32_t blob_id) {
   return 0;
 }
 
-DrmEventListener *DrmDevice::event_listener() {
-  return &event_listener_;
+int DrmDevice::ImportPrimeFd(int prime_fd, uint32_t *gem_handle) {
+  struct stat st;
+  if (fstat(prime_fd, &st)) {
+    ALOGE("Failed to stat prime fd %d %d", prime_fd, errno);
+    return -errno;
+  }
+  DmaBufKey key(st.st_dev, st.st_ino);
+
+  // The lock is held across the ioctls so that a concurrent release can't
+  // close a handle the kernel is just about to hand out again.
+  std::lock_guard<std::mutex> lock(gem_handle_lock_);
+  auto it = dma_buf_handles_.find(key);
+  if (it != dma_buf_handles_.end()) {
+    gem_handle_refs_[it->second].refcount++;
+    *gem_handle = it->second;
+    return 0;
+  }
+
+  uint32_t handle;
+  int ret = drmPrimeFDToHandle(fd(), prime_fd, &handle);
+  if (ret) {
+    ALOGE("Failed to import prime fd %d ret=%d", prime_fd, ret);
+    return ret;
+  }
+
+  dma_buf_handles_[key] = handle;
+  gem_handle_refs_[handle] = {key, 1};
+  *gem_handle = handle;
+  return 0;
 }
 
-int DrmDevice::GetProperty(uint32_t obj_id, uint32_t obj_type,
-                           const char *prop_name, DrmProperty *property) {
+int DrmDevice::ReleaseGemHandle(uint32_t gem_handle) {
+  std::lock_guard<std::mutex> lock(gem_handle_lock_);
+  auto it = gem_handle_refs_.find(gem_handle);
+  if (it == gem_handle_refs_.end()) {
+    ALOGE("Releasing unknown gem handle %" PRIu32, gem_handle);
+    return -EINVAL;
+  }
+
+  if (--it->second.refcount)
+    return 0;
+
+  dma_buf_handles_.erase(it->second.key);
+  gem_handle_refs_.erase(it);
+
+  struct drm_gem_close gem_close;
+  memset(&gem_close, 0, sizeof(gem_close));
+  gem_close.handle = gem_handle;
+  int ret = drmIoctl(fd(), DRM_IOCTL_GEM_CLOSE, &gem_close);
+  if (ret) {
+    ALOGE("Failed to close gem handle %" PRIu32 " %d", gem_handle, ret);
+    return ret;
+  }
+  return 0;
+}
+
+bool DrmDevice::IsPropertyCommitted(uint32_t object_id, uint32_t property_id,
+                                    uint64_t value) {
+  std::lock_guard<std::mutex> lock(committed_props_lock_);
+  auto it = committed_props_.find(std::make_pair(object_id, property_id));
+  return it != committed_props_.end() && it->second == value;
+}
+
+void DrmDevice::SetCommittedProperties(const PropertyValues &values) {
+  std::lock_guard<std::mutex> lock(committed_props_lock_);
+  for (const auto &value : values)
+    committed_props_[value.first] = value.second;
+}
+
+void DrmDevice::InvalidateCommittedProperties(
+    const std::vector<uint32_t> &object_ids) {
+  std::lock_guard<std::mutex> lock(committed_props_lock_);
+  for (auto it = committed_props_.begin(); it != committed_props_.end();) {
+    if (std::find(object_ids.begin(), object_ids.end(), it->first.first) !=
+        object_ids.end())
+      it = committed_props_.erase(it);
+    else
+      ++it;
+  }
+}
+
+int DrmDevice::CreateFramebuffer(hwc_drm_bo_t *bo) {
+  bool has_modifiers = false;
+  int num_planes = sizeof(bo->gem_handles) / sizeof(bo->gem_handles[0]);
+  for (int i = 0; i < num_planes; i++) {
+    if (!bo->gem_handles[i])
+      bo->modifiers[i] = 0;
+    else if (bo->modifiers[i] != DRM_FORMAT_MOD_LINEAR &&
+             bo->modifiers[i] != DRM_FORMAT_MOD_INVALID)
+      has_modifiers = true;
+  }
+
+  int ret;
+  if (!has_modifiers) {
+    ret = drmModeAddFB2(fd(), bo->width, bo->height, bo->format,
+                        bo->gem_handles, bo->pitches, bo->offsets, &bo->fb_id,
+                        0);
+  } else if (!supports_fb_modifiers_) {
+    ALOGE("Buffer has modifier 0x%" PRIx64 " but the device takes none",
+          bo->modifiers[0]);
+    return -EINVAL;
+  } else {
+    ret = drmModeAddFB2WithModifiers(fd(), bo->width, bo->height, bo->format,
+                                     bo->gem_handles, bo->pitches, bo->offsets,
+                                     bo->modifiers, &bo->fb_id,
+                                     DRM_MODE_FB_MODIFIERS);
+  }
+  if (ret) {
+    ALOGE("could not create drm fb %d", ret);
+    return ret;
+  }
+  return 0;
+}
+
+int DrmDevice::FetchPropertiesLocked(uint32_t obj_id, uint32_t obj_type) {
   drmModeObjectPropertiesPtr props;
 
   props = drmModeObjectGetProperties(fd(), obj_id, obj_type);
@@ -453,18 +572,51 @@ int DrmDevice::GetProperty(uint32_t obj_id, uint32_t obj_type,
     return -ENODEV;
   }
 
-  bool found = false;
-  for (int i = 0; !found && (size_t)i < props->count_props; ++i) {
-    drmModePropertyPtr p = drmModeGetProperty(fd(), props->props[i]);
-    if (!strcmp(p->name, prop_name)) {
-      property->Init(p, props->prop_values[i]);
-      found = true;
+  ObjectProperties &object = object_properties_[obj_id];
+  object.clear();
+  for (int i = 0; (size_t)i < props->count_props; ++i) {
+    uint32_t prop_id = props->props[i];
+    auto info = property_info_.find(prop_id);
+    if (info == property_info_.end()) {
+      drmModePropertyPtr p = drmModeGetProperty(fd(), prop_id);
+      if (!p) {
+        ALOGE("Failed to get property %" PRIu32 " of %d/%x", prop_id, obj_id,
+              obj_type);
+        continue;
+      }
+      info = property_info_.emplace(prop_id, nullptr).first;
+      info->second.reset(p);
     }
-    drmModeFreeProperty(p);
+    object[info->second->name] =
+        std::make_pair(prop_id, props->prop_values[i]);
   }
 
   drmModeFreeObjectProperties(props);
-  return found ? 0 : -ENOENT;
+  return 0;
+}
+
+int DrmDevice::GetProperty(uint32_t obj_id, uint32_t obj_type,
+                           const char *prop_name, DrmProperty *property) {
+  std::lock_guard<std::mutex> lock(properties_lock_);
+  auto object = object_properties_.find(obj_id);
+  if (object == object_properties_.end()) {
+    int ret = FetchPropertiesLocked(obj_id, obj_type);
+    if (ret)
+      return ret;
+    object = object_properties_.find(obj_id);
+  }
+
+  auto prop = object->second.find(prop_name);
+  if (prop == object->second.end())
+    return -ENOENT;
+
+  property->Init(property_info_[prop->second.first].get(), prop->second.second);
+  return 0;
+}
+
+int DrmDevice::RefreshProperties(uint32_t obj_id, uint32_t obj_type) {
+  std::lock_guard<std::mutex> lock(properties_lock_);
+  return FetchPropertiesLocked(obj_id, obj_type);
 }
 
 int DrmDevice::GetPlaneProperty(const DrmPlane &plane, const char *prop_name,
@@ -17,15 +17,22 @@
 #ifndef ANDROID_DRM_H_
 #define ANDROID_DRM_H_
 
+#include "commitaggregator.h"
 #include "drmconnector.h"
 #include "drmcrtc.h"
 #include "drmencoder.h"
 #include "drmeventlistener.h"
 #include "drmplane.h"
 #include "platform.h"
+#include "vblankdispatcher.h"
 
 #include <stdint.h>
+#include <sys/types.h>
+#include <map>
+#include <mutex>
+#include <string>
 #include <tuple>
+#include <unordered_map>
 
 namespace android {
 
@@ -34,7 +41,14 @@ class DrmDevice {
   DrmDevice();
   ~DrmDevice();
 
-  std::tuple<int, int> Init(const char *path, int num_displays);
+  // Opens the device at path and probes its crtcs, encoders, connectors and
+  // planes. Doesn't depend on any other device, so devices may be probed
+  // concurrently.
+  int Init(const char *path);
+
+  // Numbers the device's displays starting at num_displays and sets up their
+  // pipes. Returns the status and the number of displays added.
+  std::tuple<int, int> AssignDisplays(int num_displays);
 
   int fd() const {
     return fd_.get();
@@ -61,7 +75,12 @@ class DrmDevice {
   DrmConnector *AvailableWritebackConnector(int display) const;
   DrmCrtc *GetCrtcForDisplay(int display) const;
   DrmPlane *GetPlane(uint32_t id) const;
-  DrmEventListener *event_listener();
+  VBlankDispatcher *vblank_dispatcher() {
+    return &vblank_dispatcher_;
+  }
+  CommitAggregator *commit_aggregator() {
+    return &commit_aggregator_;
+  }
 
   int GetPlaneProperty(const DrmPlane &plane, const char *prop_name,
                        DrmProperty *property);
@@ -70,37 +89,93 @@ class DrmDevice {
   int GetConnectorProperty(const DrmConnector &connector, const char *prop_name,
                            DrmProperty *property);
 
+  // Property lookups are served from a per-object cache filled on first use.
+  // This re-reads the current values of the object's properties from the
+  // kernel, later lookups return them.
+  int RefreshProperties(uint32_t obj_id, uint32_t obj_type);
+
   const std::vector<std::unique_ptr<DrmCrtc>> &crtcs() const;
   uint32_t next_mode_id();
 
   int CreatePropertyBlob(void *data, size_t length, uint32_t *blob_id);
   int DestroyPropertyBlob(uint32_t blob_id);
+
+  // Importing a dma-buf which is already imported on this device hands out
+  // the existing gem handle without calling into the kernel. The handle is
+  // only closed once every import of it has been released.
+  int ImportPrimeFd(int prime_fd, uint32_t *gem_handle);
+  int ReleaseGemHandle(uint32_t gem_handle);
+
+  // Adds a framebuffer for bo, passing its format modifiers on to the kernel
+  // if any of its planes isn't linear
+  int CreateFramebuffer(hwc_drm_bo_t *bo);
+
+  // Shadow of the KMS property values left in the kernel by successful atomic
+  // commits, keyed by object and property id. Lets commits leave out the
+  // properties they wouldn't change.
+  typedef std::map<std::pair<uint32_t, uint32_t>, uint64_t> PropertyValues;
+  bool IsPropertyCommitted(uint32_t object_id, uint32_t property_id,
+                           uint64_t value);
+  void SetCommittedProperties(const PropertyValues &values);
+  // Forgets the shadowed values of the properties of object_ids, e.g. the
+  // crtc, connector and planes of a display whose state got reset
+  void InvalidateCommittedProperties(const std::vector<uint32_t> &object_ids);
+
   bool HandlesDisplay(int display) const;
-  void RegisterHotplugHandler(DrmEventHandler *handler) {
-    event_listener_.RegisterHotplugHandler(handler);
-  }
 
  private:
   int TryEncoderForDisplay(int display, DrmEncoder *enc);
   int GetProperty(uint32_t obj_id, uint32_t obj_type, const char *prop_name,
                   DrmProperty *property);
 
+  // Property id and current value, by property name
+  typedef std::unordered_map<std::string, std::pair<uint32_t, uint64_t>>
+      ObjectProperties;
+  int FetchPropertiesLocked(uint32_t obj_id, uint32_t obj_type);
+
   int CreateDisplayPipe(DrmConnector *connector);
   int AttachWriteback(DrmConnector *display_conn);
 
   UniqueFd fd_;
   uint32_t mode_id_ = 0;
+  bool supports_fb_modifiers_ = false;
 
   std::vector<std::unique_ptr<DrmConnector>> connectors_;
   std::vector<std::unique_ptr<DrmConnector>> writeback_connectors_;
   std::vector<std::unique_ptr<DrmEncoder>> encoders_;
   std::vector<std::unique_ptr<DrmCrtc>> crtcs_;
   std::vector<std::unique_ptr<DrmPlane>> planes_;
-  DrmEventListener event_listener_;
+  VBlankDispatcher vblank_dispatcher_;
+  CommitAggregator commit_aggregator_;
 
   std::pair<uint32_t, uint32_t> min_resolution_;
   std::pair<uint32_t, uint32_t> max_resolution_;
   std::map<int, int> displays_;
+
+  // dma-bufs are identified by the inode backing their file descriptors
+  typedef std::pair<dev_t, ino_t> DmaBufKey;
+  struct GemHandleRef {
+    DmaBufKey key;
+    uint32_t refcount;
+  };
+  std::mutex gem_handle_lock_;
+  std::map<DmaBufKey, uint32_t> dma_buf_handles_;
+  std::map<uint32_t, GemHandleRef> gem_handle_refs_;
+
+  std::mutex committed_props_lock_;
+  PropertyValues committed_props_;
+
+  // Property ids are shared by every object exposing the property, so the
+  // description of each is only fetched once per device
+  struct PropertyDeleter {
+    void operator()(drmModePropertyPtr p) const {
+      drmModeFreeProperty(p);
+    }
+  };
+  std::mutex properties_lock_;
+  std::map<uint32_t, std::unique_ptr<drmModePropertyRes, PropertyDeleter>>
+      property_info_;
+  std::map<uint32_t, ObjectProperties> object_properties_;
 };
 }
 
@@ -114,6 +114,10 @@ int DrmDisplayComposition::Plan(std::vector<DrmPlane *> *primary_planes,
     return ret;
   }
 
+  unplaced_layers_.clear();
+  for (auto &i : to_composite)
+    unplaced_layers_.push_back(i.first);
+
   // Remove the planes we used from the pool before returning. This ensures they
   // won't be reused by another display in the composition.
   for (auto &i : composition_planes_) {
@@ -158,6 +162,10 @@ static const char *DPMSModeToString(int dpms_mode) {
   switch (dpms_mode) {
     case DRM_MODE_DPMS_ON:
       return "ON";
+    case DRM_MODE_DPMS_STANDBY:
+      return "STANDBY";
+    case DRM_MODE_DPMS_SUSPEND:
+      return "SUSPEND";
     case DRM_MODE_DPMS_OFF:
       return "OFF";
     default:
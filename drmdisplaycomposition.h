@@ -131,6 +131,11 @@ class DrmDisplayComposition {
     return composition_planes_;
   }
 
+  // Indices of the layers Plan() found no plane for
+  const std::vector<size_t> &unplaced_layers() const {
+    return unplaced_layers_;
+  }
+
   bool geometry_changed() const {
     return geometry_changed_;
   }
@@ -190,6 +195,7 @@ class DrmDisplayComposition {
   bool geometry_changed_;
   std::vector<DrmHwcLayer> layers_;
   std::vector<DrmCompositionPlane> composition_planes_;
+  std::vector<size_t> unplaced_layers_;
 
   uint64_t frame_no_ = 0;
 };
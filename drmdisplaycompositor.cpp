@@ -19,13 +19,17 @@
 
 #include "drmdisplaycompositor.h"
 
+#include <inttypes.h>
 #include <pthread.h>
 #include <sched.h>
 #include <stdlib.h>
+#include <sys/timerfd.h>
 #include <time.h>
+#include <unistd.h>
 #include <sstream>
 #include <vector>
 
+#include <cutils/properties.h>
 #include <log/log.h>
 #include <drm/drm_mode.h>
 #include <sync/sync.h>
@@ -40,6 +44,22 @@ static const uint32_t kWaitWritebackFence = 100;  // ms
 
 namespace android {
 
+static void HashCombine(uint64_t *hash, uint64_t value) {
+  *hash ^= value + 0x9e3779b97f4a7c15ULL + (*hash << 6) + (*hash >> 2);
+}
+
+// Adds the property to pset, unless the last commit already left it at value.
+// Returns what drmModeAtomicAddProperty() would.
+static int AddPropertyDelta(DrmDevice *drm, drmModeAtomicReqPtr pset,
+                            DrmDevice::PropertyValues *values,
+                            uint32_t object_id, uint32_t property_id,
+                            uint64_t value) {
+  (*values)[std::make_pair(object_id, property_id)] = value;
+  if (drm->IsPropertyCommitted(object_id, property_id, value))
+    return drmModeAtomicGetCursor(pset);
+  return drmModeAtomicAddProperty(pset, object_id, property_id, value);
+}
+
 class CompositorVsyncCallback : public VsyncCallback {
  public:
   CompositorVsyncCallback(DrmDisplayCompositor *compositor)
@@ -54,16 +74,35 @@ class CompositorVsyncCallback : public VsyncCallback {
   DrmDisplayCompositor *compositor_;
 };
 
+class CompositorFlipHandler : public DrmEventHandler {
+ public:
+  CompositorFlipHandler(DrmDisplayCompositor *compositor, uint64_t flip_seq)
+      : compositor_(compositor), flip_seq_(flip_seq) {
+  }
+
+  void HandleEvent(uint64_t timestamp_us) {
+    compositor_->FlipComplete(flip_seq_, timestamp_us);
+  }
+
+ private:
+  DrmDisplayCompositor *compositor_;
+  uint64_t flip_seq_;
+};
+
 DrmDisplayCompositor::DrmDisplayCompositor()
     : resource_manager_(NULL),
       display_(-1),
       initialized_(false),
-      active_(false),
+      dpms_mode_(DRM_MODE_DPMS_ON),
       use_hw_overlays_(true),
       dump_frames_composited_(0),
       dump_last_timestamp_ns_(0),
       flatten_countdown_(FLATTEN_COUNTDOWN_INIT),
-      writeback_fence_(-1) {
+      writeback_fence_(-1),
+      nonblocking_commit_(false),
+      flip_pending_(false),
+      idle_refresh_ms_(0),
+      vrr_requested_(false) {
   struct timespec ts;
   if (clock_gettime(CLOCK_MONOTONIC, &ts))
     return;
@@ -74,15 +113,21 @@ DrmDisplayCompositor::~DrmDisplayCompositor() {
   if (!initialized_)
     return;
 
-  vsync_worker_.Exit();
+  commit_worker_.Exit();
+
+  if (idle_timer_fd_.get() >= 0)
+    resource_manager_->event_listener()->RemoveFd(idle_timer_fd_.get());
+
+  // The flip handler points back at us, let it fire before going away
+  WaitForPendingFlip();
+  PutModeBlob();
+  PutSeamlessModeBlob();
+
+  DrmDevice *drm = resource_manager_->GetDrmDevice(display_);
+  drm->vblank_dispatcher()->UnregisterCallback(vsync_callback_);
   int ret = pthread_mutex_lock(&lock_);
   if (ret)
     ALOGE("Failed to acquire compositor lock %d", ret);
-  DrmDevice *drm = resource_manager_->GetDrmDevice(display_);
-  if (mode_.blob_id)
-    drm->DestroyPropertyBlob(mode_.blob_id);
-  if (mode_.old_blob_id)
-    drm->DestroyPropertyBlob(mode_.old_blob_id);
 
   active_composition_.reset();
 
@@ -108,9 +153,50 @@ int DrmDisplayCompositor::Init(ResourceManager *resource_manager, int display) {
   }
   planner_ = Planner::CreateInstance(drm);
 
-  vsync_worker_.Init(drm, display_);
-  auto callback = std::make_shared<CompositorVsyncCallback>(this);
-  vsync_worker_.RegisterCallback(callback);
+  char nonblocking_commit_prop[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.nonblocking_commit", nonblocking_commit_prop, "0");
+  nonblocking_commit_ = strtol(nonblocking_commit_prop, NULL, 10);
+  DrmCrtc *crtc = drm->GetCrtcForDisplay(display_);
+  if (nonblocking_commit_ && (!crtc || !crtc->out_fence_ptr_property().id())) {
+    // Without an out fence there is nothing to release the buffers of a frame
+    // that's still being scanned out with
+    ALOGW("No OUT_FENCE_PTR, non-blocking commits disabled for display %d",
+          display_);
+    nonblocking_commit_ = false;
+  }
+
+  char vrr_prop[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.vrr", vrr_prop, "0");
+  vrr_requested_ = strtol(vrr_prop, NULL, 10);
+
+  CommitAggregator *aggregator = drm->commit_aggregator();
+  ret = commit_worker_.Init(this, drm->vblank_dispatcher(),
+                            aggregator->enabled() ? aggregator : NULL,
+                            display_);
+  if (ret) {
+    ALOGE("Failed to initialize commit worker for display %d %d", display_,
+          ret);
+    return ret;
+  }
+
+  vsync_callback_ = std::make_shared<CompositorVsyncCallback>(this);
+  drm->vblank_dispatcher()->RegisterCallback(display_, vsync_callback_);
+
+  char idle_refresh_prop[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.idle_refresh_ms", idle_refresh_prop, "0");
+  idle_refresh_ms_ = strtol(idle_refresh_prop, NULL, 10);
+  if (idle_refresh_ms_ > 0) {
+    idle_timer_fd_.Set(
+        timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC));
+    if (idle_timer_fd_.get() < 0 ||
+        resource_manager_->event_listener()->AddFd(
+            idle_timer_fd_.get(), [this]() { IdleTimeout(); })) {
+      ALOGW("Failed to set up idle timer, no idle refresh rate for display %d",
+            display_);
+      idle_timer_fd_.Close();
+      idle_refresh_ms_ = 0;
+    }
+  }
 
   initialized_ = true;
   return 0;
@@ -179,7 +265,22 @@ int DrmDisplayCompositor::DisablePlanes(DrmDisplayComposition *display_comp) {
       return ret;
     }
   }
+
+  DrmCrtc *crtc = display_comp->crtc();
+  uint64_t out_fence = -1;
+  if (crtc->out_fence_ptr_property().id() != 0) {
+    ret = drmModeAtomicAddProperty(pset, crtc->id(),
+                                   crtc->out_fence_ptr_property().id(),
+                                   (uint64_t)&out_fence) < 0;
+    if (ret) {
+      ALOGE("Failed to add OUT_FENCE_PTR property to pset");
+      drmModeAtomicFree(pset);
+      return ret;
+    }
+  }
+
   DrmDevice *drm = resource_manager_->GetDrmDevice(display_);
+  WaitForPendingFlip();
   ret = drmModeAtomicCommit(drm->fd(), pset, 0, drm);
   if (ret) {
     ALOGE("Failed to commit pset ret=%d\n", ret);
@@ -188,6 +289,9 @@ int DrmDisplayCompositor::DisablePlanes(DrmDisplayComposition *display_comp) {
   }
 
   drmModeAtomicFree(pset);
+  // The commit was blocking, this one has signaled already
+  if (crtc->out_fence_ptr_property().id() != 0)
+    clear_fence_.Set((int)out_fence);
   return 0;
 }
 
@@ -261,6 +365,29 @@ int DrmDisplayCompositor::CommitFrame(DrmDisplayComposition *display_comp,
     return -ENOMEM;
   }
 
+  // Every state property this commit sets, whether or not it had to be added
+  // to pset. Recorded as committed once the commit lands.
+  DrmDevice::PropertyValues values;
+
+  // Hash of everything the kernel's atomic check looks at, leaving out the
+  // framebuffer and fence ids which change every frame but don't affect the
+  // verdict. Writeback commits aren't cached.
+  bool cache_verdict = writeback_buffer == NULL;
+  uint64_t state_hash = 0;
+  HashCombine(&state_hash, mode_.needs_modeset);
+  HashCombine(&state_hash, mode_.needs_modeset ? mode_.blob_id : 0);
+  // A modeset also programs the power state
+  bool crtc_active = dpms_mode_ != DRM_MODE_DPMS_OFF;
+  HashCombine(&state_hash, mode_.needs_modeset && crtc_active);
+  HashCombine(&state_hash, mode_.seamless_blob_id);
+
+  // Let the panel follow the content when it can
+  bool set_vrr = vrr_requested_ && crtc->vrr_enabled_property().id();
+  float min_hz, max_hz;
+  uint64_t vrr_enabled = set_vrr && connector->vrr_capable() &&
+                         connector->GetRefreshRange(&min_hz, &max_hz);
+  HashCombine(&state_hash, vrr_enabled);
+
   if (writeback_buffer != NULL) {
     if (writeback_conn == NULL) {
       ALOGE("Invalid arguments requested writeback without writeback conn");
@@ -283,24 +410,43 @@ int DrmDisplayCompositor::CommitFrame(DrmDisplayComposition *display_comp,
     }
   }
 
+  if (set_vrr) {
+    ret = AddPropertyDelta(drm, pset, &values, crtc->id(),
+                           crtc->vrr_enabled_property().id(), vrr_enabled);
+    if (ret < 0) {
+      ALOGE("Failed to add VRR_ENABLED property to pset: %d", ret);
+      drmModeAtomicFree(pset);
+      return ret;
+    }
+  }
+
   if (mode_.needs_modeset) {
-    ret = drmModeAtomicAddProperty(pset, crtc->id(), crtc->active_property().id(), 1);
+    ret = AddPropertyDelta(drm, pset, &values, crtc->id(),
+                           crtc->active_property().id(), crtc_active);
     if (ret < 0) {
       ALOGE("Failed to add crtc active to pset\n");
       drmModeAtomicFree(pset);
       return ret;
     }
 
-    ret = drmModeAtomicAddProperty(pset, crtc->id(), crtc->mode_property().id(),
-                                   mode_.blob_id) < 0 ||
-          drmModeAtomicAddProperty(pset, connector->id(),
-                                   connector->crtc_id_property().id(),
-                                   crtc->id()) < 0;
+    ret = AddPropertyDelta(drm, pset, &values, crtc->id(),
+                           crtc->mode_property().id(), mode_.blob_id) < 0 ||
+          AddPropertyDelta(drm, pset, &values, connector->id(),
+                           connector->crtc_id_property().id(), crtc->id()) < 0;
     if (ret) {
       ALOGE("Failed to add blob %d to pset", mode_.blob_id);
       drmModeAtomicFree(pset);
       return ret;
     }
+  } else if (mode_.seamless_blob_id) {
+    ret = AddPropertyDelta(drm, pset, &values, crtc->id(),
+                           crtc->mode_property().id(),
+                           mode_.seamless_blob_id);
+    if (ret < 0) {
+      ALOGE("Failed to add blob %d to pset", mode_.seamless_blob_id);
+      drmModeAtomicFree(pset);
+      return ret;
+    }
   }
 
   for (DrmCompositionPlane &comp_plane : comp_planes) {
@@ -367,12 +513,16 @@ int DrmDisplayCompositor::CommitFrame(DrmDisplayComposition *display_comp,
       }
     }
 
+    HashCombine(&state_hash, plane->id());
+
     // Disable the plane if there's no framebuffer
     if (fb_id < 0) {
-      ret = drmModeAtomicAddProperty(pset, plane->id(),
-                                     plane->crtc_property().id(), 0) < 0 ||
-            drmModeAtomicAddProperty(pset, plane->id(),
-                                     plane->fb_property().id(), 0) < 0;
+      HashCombine(&state_hash, 0);
+      // Planes that are already off don't need to be in the request at all
+      ret = AddPropertyDelta(drm, pset, &values, plane->id(),
+                             plane->crtc_property().id(), 0) < 0 ||
+            AddPropertyDelta(drm, pset, &values, plane->id(),
+                             plane->fb_property().id(), 0) < 0;
       if (ret) {
         ALOGE("Failed to add plane %d disable to pset", plane->id());
         break;
@@ -394,33 +544,48 @@ int DrmDisplayCompositor::CommitFrame(DrmDisplayComposition *display_comp,
       break;
     }
 
-    ret = drmModeAtomicAddProperty(pset, plane->id(),
-                                   plane->crtc_property().id(), crtc->id()) < 0;
-    ret |= drmModeAtomicAddProperty(pset, plane->id(),
-                                    plane->fb_property().id(), fb_id) < 0;
-    ret |= drmModeAtomicAddProperty(pset, plane->id(),
-                                    plane->crtc_x_property().id(),
-                                    display_frame.left) < 0;
-    ret |= drmModeAtomicAddProperty(pset, plane->id(),
-                                    plane->crtc_y_property().id(),
-                                    display_frame.top) < 0;
-    ret |= drmModeAtomicAddProperty(
-               pset, plane->id(), plane->crtc_w_property().id(),
-               display_frame.right - display_frame.left) < 0;
-    ret |= drmModeAtomicAddProperty(
-               pset, plane->id(), plane->crtc_h_property().id(),
-               display_frame.bottom - display_frame.top) < 0;
-    ret |= drmModeAtomicAddProperty(pset, plane->id(),
-                                    plane->src_x_property().id(),
-                                    (int)(source_crop.left) << 16) < 0;
-    ret |= drmModeAtomicAddProperty(pset, plane->id(),
-                                    plane->src_y_property().id(),
-                                    (int)(source_crop.top) << 16) < 0;
-    ret |= drmModeAtomicAddProperty(
-               pset, plane->id(), plane->src_w_property().id(),
+    DrmHwcLayer &layer = layers[source_layers.front()];
+    HashCombine(&state_hash, crtc->id());
+    HashCombine(&state_hash, display_frame.left);
+    HashCombine(&state_hash, display_frame.top);
+    HashCombine(&state_hash, display_frame.right);
+    HashCombine(&state_hash, display_frame.bottom);
+    HashCombine(&state_hash, (int)source_crop.left);
+    HashCombine(&state_hash, (int)source_crop.top);
+    HashCombine(&state_hash, (int)source_crop.right);
+    HashCombine(&state_hash, (int)source_crop.bottom);
+    HashCombine(&state_hash, rotation);
+    HashCombine(&state_hash, alpha);
+    HashCombine(&state_hash, layer.buffer->format);
+    HashCombine(&state_hash, layer.buffer->modifiers[0]);
+
+    ret = AddPropertyDelta(drm, pset, &values, plane->id(),
+                           plane->crtc_property().id(), crtc->id()) < 0;
+    ret |= AddPropertyDelta(drm, pset, &values, plane->id(),
+                            plane->fb_property().id(), fb_id) < 0;
+    ret |= AddPropertyDelta(drm, pset, &values, plane->id(),
+                            plane->crtc_x_property().id(),
+                            display_frame.left) < 0;
+    ret |= AddPropertyDelta(drm, pset, &values, plane->id(),
+                            plane->crtc_y_property().id(),
+                            display_frame.top) < 0;
+    ret |= AddPropertyDelta(drm, pset, &values, plane->id(),
+                            plane->crtc_w_property().id(),
+                            display_frame.right - display_frame.left) < 0;
+    ret |= AddPropertyDelta(drm, pset, &values, plane->id(),
+                            plane->crtc_h_property().id(),
+                            display_frame.bottom - display_frame.top) < 0;
+    ret |= AddPropertyDelta(drm, pset, &values, plane->id(),
+                            plane->src_x_property().id(),
+                            (int)(source_crop.left) << 16) < 0;
+    ret |= AddPropertyDelta(drm, pset, &values, plane->id(),
+                            plane->src_y_property().id(),
+                            (int)(source_crop.top) << 16) < 0;
+    ret |= AddPropertyDelta(
+               drm, pset, &values, plane->id(), plane->src_w_property().id(),
                (int)(source_crop.right - source_crop.left) << 16) < 0;
-    ret |= drmModeAtomicAddProperty(
-               pset, plane->id(), plane->src_h_property().id(),
+    ret |= AddPropertyDelta(
+               drm, pset, &values, plane->id(), plane->src_h_property().id(),
                (int)(source_crop.bottom - source_crop.top) << 16) < 0;
     if (ret) {
       ALOGE("Failed to add plane %d to set", plane->id());
@@ -428,9 +593,8 @@ int DrmDisplayCompositor::CommitFrame(DrmDisplayComposition *display_comp,
     }
 
     if (plane->rotation_property().id()) {
-      ret = drmModeAtomicAddProperty(pset, plane->id(),
-                                     plane->rotation_property().id(),
-                                     rotation) < 0;
+      ret = AddPropertyDelta(drm, pset, &values, plane->id(),
+                             plane->rotation_property().id(), rotation) < 0;
       if (ret) {
         ALOGE("Failed to add rotation property %d to plane %d",
               plane->rotation_property().id(), plane->id());
@@ -439,9 +603,8 @@ int DrmDisplayCompositor::CommitFrame(DrmDisplayComposition *display_comp,
     }
 
     if (plane->alpha_property().id()) {
-      ret = drmModeAtomicAddProperty(pset, plane->id(),
-                                     plane->alpha_property().id(),
-                                     alpha) < 0;
+      ret = AddPropertyDelta(drm, pset, &values, plane->id(),
+                             plane->alpha_property().id(), alpha) < 0;
       if (ret) {
         ALOGE("Failed to add alpha property %d to plane %d",
               plane->alpha_property().id(), plane->id());
@@ -450,43 +613,94 @@ int DrmDisplayCompositor::CommitFrame(DrmDisplayComposition *display_comp,
     }
   }
 
+  // Nothing differs from what the kernel already has, nothing to commit
+  if (!ret && !drmModeAtomicGetCursor(pset)) {
+    drmModeAtomicFree(pset);
+    return 0;
+  }
+
   if (!ret) {
-    uint32_t flags = DRM_MODE_ATOMIC_ALLOW_MODESET;
+    int verdict;
+    if (test_only && cache_verdict && LookupTestVerdict(state_hash, &verdict)) {
+      drmModeAtomicFree(pset);
+      return verdict;
+    }
+
+    uint32_t flags = 0;
+    if (mode_.needs_modeset)
+      flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
     if (test_only)
       flags |= DRM_MODE_ATOMIC_TEST_ONLY;
 
-    ret = drmModeAtomicCommit(drm->fd(), pset, flags, drm);
+    // Modesets and writeback commits stay blocking, the code below and the
+    // writeback fence wait rely on them having landed.
+    bool nonblock = !test_only && nonblocking_commit_ &&
+                    !mode_.needs_modeset && writeback_buffer == NULL;
+    CompositorFlipHandler *flip_handler = NULL;
+    if (!test_only) {
+      // The kernel only takes one commit per crtc at a time, queue this one
+      // behind the flip that is still in flight.
+      WaitForPendingFlip();
+    }
+    if (nonblock) {
+      flags |= DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT;
+      flip_handler = new CompositorFlipHandler(this, BeginFlip());
+    }
+
+    // Frames of displays sharing the device go out together when they can,
+    // modesets and writeback commits on their own
+    CommitAggregator *aggregator = drm->commit_aggregator();
+    if (!test_only && aggregator->enabled() && !mode_.needs_modeset &&
+        writeback_buffer == NULL) {
+      ret = aggregator->Commit(display_, crtc->id(), pset, flags, flip_handler);
+    } else {
+      ret = drmModeAtomicCommit(drm->fd(), pset, flags,
+                                nonblock ? (void *)flip_handler : (void *)drm);
+      // A commit we don't track (e.g. another display sharing a plane) can
+      // still be in flight, back off and retry until it has landed.
+      for (int waited_ms = 0; ret == -EBUSY && nonblock &&
+                              waited_ms < kFlipTimeoutMs;
+           waited_ms += kFlipBusyRetryMs) {
+        usleep(kFlipBusyRetryMs * 1000);
+        ret = drmModeAtomicCommit(drm->fd(), pset, flags, flip_handler);
+      }
+    }
+    if (ret && nonblock) {
+      delete flip_handler;
+      AbortFlip();
+    }
+    // Only remember answers about the configuration itself; anything else
+    // (-EBUSY, -ENOMEM, ...) says nothing about the next attempt.
+    if (cache_verdict && (ret == 0 || (test_only && ret == -EINVAL)))
+      RecordTestVerdict(state_hash, ret);
     if (ret) {
       if (!test_only)
         ALOGE("Failed to commit pset ret=%d\n", ret);
       drmModeAtomicFree(pset);
       return ret;
     }
+
+    if (!test_only) {
+      drm->SetCommittedProperties(values);
+      if (set_vrr)
+        connector->set_vrr_active(vrr_enabled);
+    }
   }
   if (pset)
     drmModeAtomicFree(pset);
 
+  // The crtc state holds its own reference on the committed MODE_ID
   if (!test_only && mode_.needs_modeset) {
-    ret = drm->DestroyPropertyBlob(mode_.old_blob_id);
-    if (ret) {
-      ALOGE("Failed to destroy old mode property blob %" PRIu32 "/%d",
-            mode_.old_blob_id, ret);
-      return ret;
-    }
-
-    /* TODO: Add dpms to the pset when the kernel supports it */
-    ret = ApplyDpms(display_comp);
-    if (ret) {
-      ALOGE("Failed to apply DPMS after modeset %d\n", ret);
-      return ret;
-    }
-
     connector->set_active_mode(mode_.mode);
-    mode_.old_blob_id = mode_.blob_id;
-    mode_.blob_id = 0;
+    PutModeBlob();
     mode_.needs_modeset = false;
   }
 
+  if (!test_only && mode_.seamless_blob_id) {
+    connector->set_scanout_mode(DrmMode());
+    PutSeamlessModeBlob();
+  }
+
   if (crtc->out_fence_ptr_property().id()) {
     display_comp->set_out_fence((int) out_fences[crtc->pipe()]);
   }
@@ -494,43 +708,344 @@ int DrmDisplayCompositor::CommitFrame(DrmDisplayComposition *display_comp,
   return ret;
 }
 
-int DrmDisplayCompositor::ApplyDpms(DrmDisplayComposition *display_comp) {
+bool DrmDisplayCompositor::LookupTestVerdict(uint64_t state_hash,
+                                             int *verdict) {
+  std::lock_guard<std::mutex> lock(test_cache_lock_);
+  for (auto it = test_cache_.begin(); it != test_cache_.end(); ++it) {
+    if (it->first != state_hash)
+      continue;
+    *verdict = it->second;
+    test_cache_.splice(test_cache_.begin(), test_cache_, it);
+    return true;
+  }
+  return false;
+}
+
+void DrmDisplayCompositor::RecordTestVerdict(uint64_t state_hash,
+                                             int verdict) {
+  std::lock_guard<std::mutex> lock(test_cache_lock_);
+  test_cache_.remove_if([state_hash](const std::pair<uint64_t, int> &entry) {
+    return entry.first == state_hash;
+  });
+  test_cache_.emplace_front(state_hash, verdict);
+  if (test_cache_.size() > kTestCacheSize)
+    test_cache_.pop_back();
+}
+
+void DrmDisplayCompositor::InvalidateTestCache() {
+  std::lock_guard<std::mutex> lock(test_cache_lock_);
+  test_cache_.clear();
+}
+
+int DrmDisplayCompositor::CommitCrtcActive(bool active) {
   DrmDevice *drm = resource_manager_->GetDrmDevice(display_);
-  DrmConnector *conn = drm->GetConnectorForDisplay(display_);
-  if (!conn) {
-    ALOGE("Failed to get DrmConnector for display %d", display_);
+  DrmCrtc *crtc = drm->GetCrtcForDisplay(display_);
+  if (!crtc) {
+    ALOGE("Could not locate crtc for display %d", display_);
     return -ENODEV;
   }
 
-  const DrmProperty &prop = conn->dpms_property();
-  int ret = drmModeConnectorSetProperty(drm->fd(), conn->id(), prop.id(),
-                                        display_comp->dpms_mode());
-  if (ret) {
-    ALOGE("Failed to set DPMS property for connector %d", conn->id());
+  drmModeAtomicReqPtr pset = drmModeAtomicAlloc();
+  if (!pset) {
+    ALOGE("Failed to allocate property set");
+    return -ENOMEM;
+  }
+
+  // The planes stay as they are, so the crtc comes back up showing the last
+  // frame
+  DrmDevice::PropertyValues values;
+  int ret = AddPropertyDelta(drm, pset, &values, crtc->id(),
+                             crtc->active_property().id(), active);
+  if (ret >= 0 && drmModeAtomicGetCursor(pset)) {
+    WaitForPendingFlip();
+    ret = drmModeAtomicCommit(drm->fd(), pset, DRM_MODE_ATOMIC_ALLOW_MODESET,
+                              drm);
+  }
+  drmModeAtomicFree(pset);
+  if (ret < 0) {
+    ALOGE("Failed to set crtc %d active=%d %d", crtc->id(), active, ret);
+    return ret;
+  }
+
+  drm->SetCommittedProperties(values);
+  InvalidateTestCache();
+  return 0;
+}
+
+int DrmDisplayCompositor::ApplyDpms(DrmDisplayComposition *display_comp) {
+  AutoLock lock(&lock_, __func__);
+  int ret = lock.Lock();
+  if (ret)
     return ret;
+
+  uint32_t dpms_mode = display_comp->dpms_mode();
+  bool crtc_active = dpms_mode != DRM_MODE_DPMS_OFF;
+  // A pending modeset programs the power state along with the mode
+  if (!mode_.needs_modeset || !crtc_active) {
+    ret = CommitCrtcActive(crtc_active);
+    if (ret)
+      return ret;
   }
+
+  dpms_mode_ = dpms_mode;
+  commit_worker_.SetVsyncEnabled(dpms_mode_ == DRM_MODE_DPMS_ON);
   return 0;
 }
 
-std::tuple<int, uint32_t> DrmDisplayCompositor::CreateModeBlob(
-    const DrmMode &mode) {
-  struct drm_mode_modeinfo drm_mode;
-  memset(&drm_mode, 0, sizeof(drm_mode));
-  mode.ToDrmModeModeInfo(&drm_mode);
+void DrmDisplayCompositor::WaitForPendingFlip() {
+  std::unique_lock<std::mutex> lock(flip_lock_);
+  if (!flip_pending_)
+    return;
+
+  ATRACE_CALL();
+  if (!flip_cond_.wait_for(lock, std::chrono::milliseconds(kFlipTimeoutMs),
+                           [this] { return !flip_pending_; })) {
+    // The flip is still queued in the kernel, which turns the next commit
+    // away with -EBUSY until it lands. Its composition may still be on screen
+    // and stays around until the flip's event finally shows up.
+    ALOGE("Timed out waiting for page flip %" PRIu64 " on display %d",
+          flip_seq_, display_);
+    flip_pending_ = false;
+    timed_out_flips_[flip_seq_] = std::move(retiring_composition_);
+  }
+}
+
+uint64_t DrmDisplayCompositor::BeginFlip() {
+  std::lock_guard<std::mutex> lock(flip_lock_);
+  flip_pending_ = true;
+  return ++flip_seq_;
+}
 
-  uint32_t id = 0;
+void DrmDisplayCompositor::AbortFlip() {
+  std::lock_guard<std::mutex> lock(flip_lock_);
+  flip_pending_ = false;
+  flip_cond_.notify_all();
+}
+
+void DrmDisplayCompositor::FlipComplete(uint64_t flip_seq,
+                                        uint64_t /* timestamp_us */) {
+  std::vector<std::unique_ptr<DrmDisplayComposition>> retired;
+  std::unique_lock<std::mutex> lock(flip_lock_);
+  // Flips on a crtc complete in order, this one landing means the ones given
+  // up on before it have landed as well
+  for (auto it = timed_out_flips_.begin();
+       it != timed_out_flips_.end() && it->first <= flip_seq;
+       it = timed_out_flips_.erase(it))
+    retired.emplace_back(std::move(it->second));
+
+  // A late event of a flip that timed out says nothing about the current one
+  if (flip_seq == flip_seq_ && flip_pending_) {
+    flip_pending_ = false;
+    retired.emplace_back(std::move(retiring_composition_));
+    flip_cond_.notify_all();
+  }
+  lock.unlock();
+
+  // The frames replaced by these flips are off screen now, release their
+  // buffers
+  retired.clear();
+}
+
+void DrmDisplayCompositor::ArmIdleTimer() {
+  if (idle_refresh_ms_ <= 0)
+    return;
+
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+  spec.it_value.tv_sec = idle_refresh_ms_ / 1000;
+  spec.it_value.tv_nsec = (idle_refresh_ms_ % 1000) * 1000 * 1000;
+  if (timerfd_settime(idle_timer_fd_.get(), 0, &spec, NULL))
+    ALOGE("Failed to arm idle timer %d", -errno);
+}
+
+const DrmMode *DrmDisplayCompositor::FindIdleMode(
+    DrmConnector *connector) const {
+  const DrmMode &active = connector->active_mode();
+  const DrmMode *idle_mode = NULL;
+  for (const DrmMode &mode : connector->modes()) {
+    if (mode.h_display() != active.h_display() ||
+        mode.v_display() != active.v_display() ||
+        (mode.flags() & DRM_MODE_FLAG_INTERLACE) !=
+            (active.flags() & DRM_MODE_FLAG_INTERLACE) ||
+        mode.v_refresh() >= active.v_refresh())
+      continue;
+    if (!idle_mode || mode.v_refresh() < idle_mode->v_refresh())
+      idle_mode = &mode;
+  }
+  return idle_mode;
+}
+
+int DrmDisplayCompositor::CommitSeamlessMode(uint32_t blob_id,
+                                             bool test_only) {
   DrmDevice *drm = resource_manager_->GetDrmDevice(display_);
-  int ret = drm->CreatePropertyBlob(&drm_mode, sizeof(struct drm_mode_modeinfo),
-                                    &id);
+  DrmCrtc *crtc = drm->GetCrtcForDisplay(display_);
+  if (!crtc)
+    return -ENODEV;
+
+  drmModeAtomicReqPtr pset = drmModeAtomicAlloc();
+  if (!pset)
+    return -ENOMEM;
+
+  uint32_t mode_property_id = crtc->mode_property().id();
+  int ret = drmModeAtomicAddProperty(pset, crtc->id(), mode_property_id,
+                                     blob_id);
+  if (ret >= 0 && test_only) {
+    // No DRM_MODE_ATOMIC_ALLOW_MODESET: if the driver needs a modeset for
+    // this, it says no
+    ret = drmModeAtomicCommit(drm->fd(), pset, DRM_MODE_ATOMIC_TEST_ONLY, drm);
+  } else if (ret >= 0) {
+    // This runs on the event listener thread, which must not block on the
+    // flip. The next commit waits for it like for any other.
+    CompositorFlipHandler *flip_handler =
+        new CompositorFlipHandler(this, BeginFlip());
+    ret = drmModeAtomicCommit(drm->fd(), pset,
+                              DRM_MODE_ATOMIC_NONBLOCK |
+                                  DRM_MODE_PAGE_FLIP_EVENT,
+                              flip_handler);
+    if (ret) {
+      delete flip_handler;
+      AbortFlip();
+    }
+  }
+  drmModeAtomicFree(pset);
+
+  if (!ret && !test_only) {
+    DrmDevice::PropertyValues values;
+    values[std::make_pair(crtc->id(), mode_property_id)] = blob_id;
+    drm->SetCommittedProperties(values);
+    InvalidateTestCache();
+  }
+  return ret;
+}
+
+void DrmDisplayCompositor::PutModeBlob() {
+  if (mode_.blob_id && mode_.blob_connector)
+    mode_.blob_connector->PutModeBlob(mode_.blob_id);
+  mode_.blob_id = 0;
+  mode_.blob_connector = NULL;
+}
+
+void DrmDisplayCompositor::PutSeamlessModeBlob() {
+  if (!mode_.seamless_blob_id)
+    return;
+
+  DrmConnector *connector =
+      resource_manager_->GetDrmDevice(display_)->GetConnectorForDisplay(
+          display_);
+  if (connector)
+    connector->PutModeBlob(mode_.seamless_blob_id);
+  mode_.seamless_blob_id = 0;
+}
+
+void DrmDisplayCompositor::IdleTimeout() {
+  uint64_t expirations;
+  while (read(idle_timer_fd_.get(), &expirations, sizeof(expirations)) > 0) {
+  }
+
+  AutoLock lock(&lock_, __func__);
+  if (lock.Lock())
+    return;
+
+  if (dpms_mode_ != DRM_MODE_DPMS_ON || !active_composition_ ||
+      mode_.needs_modeset ||
+      mode_.seamless_blob_id)
+    return;
+  {
+    // The flip event is handled on this very thread, don't wait for it
+    std::lock_guard<std::mutex> flip_lock(flip_lock_);
+    if (flip_pending_) {
+      ArmIdleTimer();
+      return;
+    }
+  }
+
+  DrmConnector *connector =
+      resource_manager_->GetDrmDevice(display_)->GetConnectorForDisplay(
+          display_);
+  // A variable refresh rate panel already slows down on its own
+  if (!connector || connector->vrr_active() ||
+      connector->scanout_mode().id() != connector->active_mode().id())
+    return;
+
+  const DrmMode *idle_mode = FindIdleMode(connector);
+  if (!idle_mode)
+    return;
+
+  uint32_t blob_id;
+  int ret = connector->GetModeBlob(*idle_mode, &blob_id);
+  if (ret)
+    return;
+
+  ATRACE_CALL();
+  ret = CommitSeamlessMode(blob_id, true);
+  if (!ret)
+    ret = CommitSeamlessMode(blob_id, false);
+  connector->PutModeBlob(blob_id);
   if (ret) {
-    ALOGE("Failed to create mode property blob %d", ret);
-    return std::make_tuple(ret, 0);
+    ALOGV("Can't switch display %d to %s without a modeset %d", display_,
+          idle_mode->name().c_str(), ret);
+    return;
+  }
+
+  ALOGI("Display %d idle, dropped to %.2fHz", display_,
+        idle_mode->v_refresh());
+  connector->set_scanout_mode(*idle_mode);
+}
+
+void DrmDisplayCompositor::PrepareRefreshRestore() {
+  DrmConnector *connector =
+      resource_manager_->GetDrmDevice(display_)->GetConnectorForDisplay(
+          display_);
+  if (!connector || mode_.needs_modeset || mode_.seamless_blob_id ||
+      connector->scanout_mode().id() == connector->active_mode().id())
+    return;
+
+  uint32_t blob_id;
+  int ret = connector->GetModeBlob(connector->active_mode(), &blob_id);
+  if (ret)
+    return;
+
+  // Prefer riding along with the frame, fall back to a full modeset if the
+  // driver won't switch back seamlessly
+  if (!CommitSeamlessMode(blob_id, true)) {
+    mode_.seamless_blob_id = blob_id;
+    return;
+  }
+
+  ALOGW("Display %d needs a modeset to leave the idle refresh rate", display_);
+  PutModeBlob();
+  mode_.mode = connector->active_mode();
+  mode_.blob_id = blob_id;
+  mode_.blob_connector = connector;
+  mode_.needs_modeset = true;
+  InvalidateTestCache();
+  InvalidateCommittedProperties(NULL);
+}
+
+void DrmDisplayCompositor::InvalidateCommittedProperties(
+    DrmConnector *writeback_conn) {
+  DrmDevice *drm = resource_manager_->GetDrmDevice(display_);
+  std::vector<uint32_t> object_ids;
+  DrmCrtc *crtc = drm->GetCrtcForDisplay(display_);
+  if (crtc) {
+    object_ids.push_back(crtc->id());
+    for (auto &plane : drm->planes()) {
+      if (plane->GetCrtcSupported(*crtc))
+        object_ids.push_back(plane->id());
+    }
   }
-  ALOGE("Create blob_id %" PRIu32 "\n", id);
-  return std::make_tuple(ret, id);
+  DrmConnector *connector = drm->GetConnectorForDisplay(display_);
+  if (connector)
+    object_ids.push_back(connector->id());
+  if (writeback_conn)
+    object_ids.push_back(writeback_conn->id());
+  drm->InvalidateCommittedProperties(object_ids);
 }
 
 void DrmDisplayCompositor::ClearDisplay() {
+  InvalidateTestCache();
+  InvalidateCommittedProperties(NULL);
+
   if (!active_composition_)
     return;
 
@@ -538,7 +1053,8 @@ void DrmDisplayCompositor::ClearDisplay() {
     return;
 
   active_composition_.reset(NULL);
-  vsync_worker_.VSyncControl(false);
+  resource_manager_->GetDrmDevice(display_)->vblank_dispatcher()->VSyncControl(
+      vsync_callback_, false);
 }
 
 void DrmDisplayCompositor::ApplyFrame(
@@ -554,6 +1070,9 @@ void DrmDisplayCompositor::ApplyFrame(
       ALOGE("Abort playing back scene");
       return;
     }
+    // Flattened scenes aren't new content, stay at the idle refresh rate
+    if (!writeback)
+      PrepareRefreshRestore();
     ret = CommitFrame(composition.get(), false);
   }
 
@@ -566,9 +1085,20 @@ void DrmDisplayCompositor::ApplyFrame(
   }
   ++dump_frames_composited_;
 
+  clear_fence_.Close();
   active_composition_.swap(composition);
 
+  // If the commit went out non-blocking, the old composition is still on
+  // screen until the flip completes. Otherwise it's released right here.
+  {
+    std::lock_guard<std::mutex> flip_lock(flip_lock_);
+    if (flip_pending_)
+      retiring_composition_ = std::move(composition);
+  }
+
   flatten_countdown_ = FLATTEN_COUNTDOWN_INIT;
+  if (!writeback)
+    ArmIdleTimer();
 }
 
 int DrmDisplayCompositor::ApplyComposition(
@@ -589,23 +1119,35 @@ int DrmDisplayCompositor::ApplyComposition(
       ApplyFrame(std::move(composition), ret);
       break;
     case DRM_COMPOSITION_TYPE_DPMS:
-      active_ = (composition->dpms_mode() == DRM_MODE_DPMS_ON);
+      // Let the frames queued before this land first
+      commit_worker_.Drain();
       ret = ApplyDpms(composition.get());
       if (ret)
         ALOGE("Failed to apply dpms for display %d", display_);
       return ret;
-    case DRM_COMPOSITION_TYPE_MODESET:
+    case DRM_COMPOSITION_TYPE_MODESET: {
+      commit_worker_.Drain();
+      DrmConnector *connector = resource_manager_->GetDrmDevice(display_)
+                                    ->GetConnectorForDisplay(display_);
+      if (!connector) {
+        ALOGE("Could not locate connector for display %d", display_);
+        return -ENODEV;
+      }
+      // A modeset still pending is superseded by this one
+      PutModeBlob();
       mode_.mode = composition->display_mode();
-      if (mode_.blob_id)
-        resource_manager_->GetDrmDevice(display_)
-            ->DestroyPropertyBlob(mode_.blob_id);
-      std::tie(ret, mode_.blob_id) = CreateModeBlob(mode_.mode);
+      ret = connector->GetModeBlob(mode_.mode, &mode_.blob_id);
       if (ret) {
         ALOGE("Failed to create mode blob for display %d", display_);
         return ret;
       }
+      mode_.blob_connector = connector;
       mode_.needs_modeset = true;
+      InvalidateTestCache();
+      // A modeset may reset state we don't track, resend everything with it
+      InvalidateCommittedProperties(NULL);
       return 0;
+    }
     default:
       ALOGE("Unknown composition type %d", composition->type());
       return -EINVAL;
@@ -614,6 +1156,33 @@ int DrmDisplayCompositor::ApplyComposition(
   return ret;
 }
 
+int DrmDisplayCompositor::QueueComposition(
+    std::unique_ptr<DrmDisplayComposition> composition, int *present_fence) {
+  if (commit_worker_.enabled())
+    return commit_worker_.QueueComposition(std::move(composition),
+                                           present_fence);
+
+  return CommitComposition(std::move(composition), present_fence);
+}
+
+int DrmDisplayCompositor::CommitComposition(
+    std::unique_ptr<DrmDisplayComposition> composition, int *out_fence) {
+  *out_fence = -1;
+  int ret = ApplyComposition(std::move(composition));
+  if (ret)
+    return ret;
+
+  AutoLock lock(&lock_, __func__);
+  ret = lock.Lock();
+  if (ret)
+    return ret;
+  if (active_composition_)
+    *out_fence = active_composition_->take_out_fence();
+  else
+    *out_fence = clear_fence_.Release();
+  return 0;
+}
+
 int DrmDisplayCompositor::TestComposition(DrmDisplayComposition *composition) {
   return CommitFrame(composition, true);
 }
@@ -633,14 +1202,14 @@ int DrmDisplayCompositor::FlattenOnDisplay(
   for (const DrmMode &mode : writeback_conn->modes()) {
     if (mode.h_display() == src_mode.h_display() &&
         mode.v_display() == src_mode.v_display()) {
+      PutModeBlob();
       mode_.mode = mode;
-      if (mode_.blob_id)
-        drm->DestroyPropertyBlob(mode_.blob_id);
-      std::tie(ret, mode_.blob_id) = CreateModeBlob(mode_.mode);
+      ret = writeback_conn->GetModeBlob(mode_.mode, &mode_.blob_id);
       if (ret) {
         ALOGE("Failed to create mode blob for display %d", display_);
         return ret;
       }
+      mode_.blob_connector = writeback_conn;
       mode_.needs_modeset = true;
       break;
     }
@@ -784,7 +1353,9 @@ int DrmDisplayCompositor::FlattenSerial(DrmConnector *writeback_conn) {
     ALOGE("Failed to Setup Writeback Commit");
     return ret;
   }
+  WaitForPendingFlip();
   ret = drmModeAtomicCommit(drm->fd(), pset, 0, drm);
+  InvalidateCommittedProperties(writeback_conn);
   if (ret) {
     ALOGE("Failed to enable writeback %d", ret);
     return ret;
@@ -938,6 +1509,9 @@ void DrmDisplayCompositor::Vsync(int display, int64_t timestamp) {
   AutoLock lock(&lock_, __func__);
   if (lock.Lock())
     return;
+  // Dozing displays keep whatever is on screen
+  if (dpms_mode_ != DRM_MODE_DPMS_ON)
+    return;
   flatten_countdown_--;
   if (!CountdownExpired())
     return;
@@ -974,5 +1548,7 @@ void DrmDisplayCompositor::Dump(std::ostringstream *out) const {
   dump_last_timestamp_ns_ = cur_ts;
 
   pthread_mutex_unlock(&lock_);
+
+  commit_worker_.Dump(out);
 }
 }
@@ -17,14 +17,19 @@
 #ifndef ANDROID_DRM_DISPLAY_COMPOSITOR_H_
 #define ANDROID_DRM_DISPLAY_COMPOSITOR_H_
 
+#include "commitworker.h"
 #include "drmhwcomposer.h"
 #include "drmdisplaycomposition.h"
 #include "drmframebuffer.h"
 #include "resourcemanager.h"
-#include "vsyncworker.h"
+#include "vblankdispatcher.h"
 
 #include <pthread.h>
+#include <condition_variable>
+#include <list>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <sstream>
 #include <tuple>
 
@@ -58,20 +63,50 @@ class DrmDisplayCompositor {
   std::unique_ptr<DrmDisplayComposition> CreateComposition() const;
   std::unique_ptr<DrmDisplayComposition> CreateInitializedComposition() const;
   int ApplyComposition(std::unique_ptr<DrmDisplayComposition> composition);
+
+  // Hands a frame composition to the commit worker, or commits it right away
+  // when the worker is disabled. On success *present_fence holds a fence that
+  // signals once the frame is on screen, or -1.
+  int QueueComposition(std::unique_ptr<DrmDisplayComposition> composition,
+                       int *present_fence);
+
+  // Commits a frame composition right away and returns the commit's out fence
+  // in *out_fence (-1 if there is none). If the frame failed and the display
+  // got cleared instead, that's the out fence of the clearing commit.
+  int CommitComposition(std::unique_ptr<DrmDisplayComposition> composition,
+                        int *out_fence);
   int TestComposition(DrmDisplayComposition *composition);
   int Composite();
   void Dump(std::ostringstream *out) const;
   void Vsync(int display, int64_t timestamp);
   void ClearDisplay();
 
+  // Called from the drm event thread when the non-blocking commit flip_seq
+  // has been latched by the hardware.
+  void FlipComplete(uint64_t flip_seq, uint64_t timestamp_us);
+
+  // Forgets every remembered atomic test verdict. Must be called whenever the
+  // display configuration changes underneath the compositor (modeset,
+  // hotplug), since a verdict only holds for the configuration it was made in.
+  void InvalidateTestCache();
+
   std::tuple<uint32_t, uint32_t, int> GetActiveModeResolution();
 
+  bool nonblocking_commit() const {
+    return nonblocking_commit_;
+  }
+
  private:
   struct ModeState {
     bool needs_modeset = false;
     DrmMode mode;
+    // Borrowed from the mode blob cache of blob_connector until committed
     uint32_t blob_id = 0;
-    uint32_t old_blob_id = 0;
+    DrmConnector *blob_connector = NULL;
+    // MODE_ID to switch to without a modeset along with the next frame, when
+    // returning from the idle refresh rate. Borrowed from the display's
+    // connector.
+    uint32_t seamless_blob_id = 0;
   };
 
   DrmDisplayCompositor(const DrmDisplayCompositor &) = delete;
@@ -81,15 +116,52 @@ class DrmDisplayCompositor {
   static const int kAcquireWaitTries = 5;
   static const int kAcquireWaitTimeoutMs = 100;
 
+  // Number of atomic test verdicts remembered by CommitFrame()
+  static const size_t kTestCacheSize = 16;
+
+  // How long to wait for an outstanding page flip before giving up on it
+  static const int kFlipTimeoutMs = 100;
+  static const int kFlipBusyRetryMs = 2;
+
   int CommitFrame(DrmDisplayComposition *display_comp, bool test_only,
                   DrmConnector *writeback_conn = NULL,
                   DrmHwcBuffer *writeback_buffer = NULL);
   int SetupWritebackCommit(drmModeAtomicReqPtr pset, uint32_t crtc_id,
                            DrmConnector *writeback_conn,
                            DrmHwcBuffer *writeback_buffer);
+  void WaitForPendingFlip();
+  // Drops the property shadow of the objects this display commits to: its
+  // crtc, connector and the planes that can go on the crtc, plus
+  // writeback_conn if not NULL
+  void InvalidateCommittedProperties(DrmConnector *writeback_conn);
+  // Marks a flip pending and returns its number, or takes it back when its
+  // commit failed
+  uint64_t BeginFlip();
+  void AbortFlip();
+  bool LookupTestVerdict(uint64_t state_hash, int *verdict);
+  void RecordTestVerdict(uint64_t state_hash, int verdict);
+  // Power states are set through the crtc's ACTIVE property. Off turns the
+  // crtc off, the doze modes (DRM_MODE_DPMS_STANDBY and SUSPEND) keep it
+  // showing the last frame with vsync and flattening stopped.
   int ApplyDpms(DrmDisplayComposition *display_comp);
+  int CommitCrtcActive(bool active);
   int DisablePlanes(DrmDisplayComposition *display_comp);
 
+  // Idle refresh rate: after idle_refresh_ms_ without a new frame the crtc
+  // is switched to the lowest refresh rate mode of the same resolution,
+  // provided the driver can do so without a modeset. The next frame switches
+  // back.
+  void ArmIdleTimer();
+  void IdleTimeout();
+  const DrmMode *FindIdleMode(DrmConnector *connector) const;
+  // Switches the crtc to the MODE_ID blob_id without a modeset. The real
+  // commit is non-blocking and leaves a flip pending.
+  int CommitSeamlessMode(uint32_t blob_id, bool test_only);
+  // Hands the MODE_ID blobs mode_ borrowed back to their connectors
+  void PutModeBlob();
+  void PutSeamlessModeBlob();
+  void PrepareRefreshRestore();
+
   void ApplyFrame(std::unique_ptr<DrmDisplayComposition> composition,
                   int status, bool writeback = false);
   int FlattenActiveComposition();
@@ -101,7 +173,6 @@ class DrmDisplayCompositor {
 
   bool CountdownExpired() const;
 
-  std::tuple<int, uint32_t> CreateModeBlob(const DrmMode &mode);
 
   ResourceManager *resource_manager_;
   int display_;
@@ -109,7 +180,7 @@ class DrmDisplayCompositor {
   std::unique_ptr<DrmDisplayComposition> active_composition_;
 
   bool initialized_;
-  bool active_;
+  uint32_t dpms_mode_;
   bool use_hw_overlays_;
 
   ModeState mode_;
@@ -124,10 +195,41 @@ class DrmDisplayCompositor {
   // we need to reset them on every Dump() call.
   mutable uint64_t dump_frames_composited_;
   mutable uint64_t dump_last_timestamp_ns_;
-  VSyncWorker vsync_worker_;
+  std::shared_ptr<VsyncCallback> vsync_callback_;
   int64_t flatten_countdown_;
   std::unique_ptr<Planner> planner_;
   int writeback_fence_;
+
+  // Verdicts of recent atomic commits keyed by a hash of the plane state they
+  // programmed, most recently used first. TestComposition() runs without
+  // lock_ held, hence the dedicated lock.
+  std::mutex test_cache_lock_;
+  std::list<std::pair<uint64_t, int>> test_cache_;
+
+  // Non-blocking commit state. While a flip is pending, the composition it
+  // replaced is still being scanned out and is kept in retiring_composition_
+  // until FlipComplete() releases it. Flips are numbered so that the late
+  // event of a flip given up on in WaitForPendingFlip() can't complete a
+  // later one; the composition it replaced waits in timed_out_flips_.
+  bool nonblocking_commit_;
+  std::mutex flip_lock_;
+  std::condition_variable flip_cond_;
+  bool flip_pending_;
+  uint64_t flip_seq_ = 0;
+  std::unique_ptr<DrmDisplayComposition> retiring_composition_;
+  std::map<uint64_t, std::unique_ptr<DrmDisplayComposition>> timed_out_flips_;
+
+  // Out fence of the commit that took the display's last frame off screen
+  UniqueFd clear_fence_;
+
+  int idle_refresh_ms_;
+  UniqueFd idle_timer_fd_;
+
+  // Enable variable refresh rate on sinks that advertise a refresh range
+  bool vrr_requested_;
+
+  // mutable since we need to lock it in Dump()
+  mutable CommitWorker commit_worker_;
 };
 }
 
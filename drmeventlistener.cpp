@@ -19,10 +19,17 @@
 #include "drmdevice.h"
 #include "drmeventlistener.h"
 
-#include <assert.h>
+#include <algorithm>
 #include <errno.h>
+#include <fcntl.h>
 #include <linux/netlink.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/timerfd.h>
 
 #include <log/log.h>
 #include <hardware/hardware.h>
@@ -31,12 +38,28 @@
 
 namespace android {
 
-DrmEventListener::DrmEventListener(DrmDevice *drm)
-    : Worker("drm-event-listener", HAL_PRIORITY_URGENT_DISPLAY), drm_(drm) {
+DrmEventListener::DrmEventListener()
+    : Worker("drm-event-listener", HAL_PRIORITY_URGENT_DISPLAY) {
+}
+
+DrmEventListener::~DrmEventListener() {
+  // Stop before the handlers and fds go away underneath the loop
+  stopping_ = true;
+  uint64_t value = 1;
+  if (exit_fd_.get() >= 0 && write(exit_fd_.get(), &value, sizeof(value)) < 0)
+    ALOGE("Failed to wake event listener %d", -errno);
+  Exit();
 }
 
 int DrmEventListener::Init() {
-  uevent_fd_.Set(socket(PF_NETLINK, SOCK_DGRAM, NETLINK_KOBJECT_UEVENT));
+  epoll_fd_.Set(epoll_create1(EPOLL_CLOEXEC));
+  if (epoll_fd_.get() < 0) {
+    ALOGE("Failed to create epoll instance %d", -errno);
+    return -errno;
+  }
+
+  uevent_fd_.Set(socket(PF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                        NETLINK_KOBJECT_UEVENT));
   if (uevent_fd_.get() < 0) {
     ALOGE("Failed to open uevent socket %d", uevent_fd_.get());
     return uevent_fd_.get();
@@ -54,85 +77,257 @@ int DrmEventListener::Init() {
     return -errno;
   }
 
-  FD_ZERO(&fds_);
-  FD_SET(drm_->fd(), &fds_);
-  FD_SET(uevent_fd_.get(), &fds_);
-  max_fd_ = std::max(drm_->fd(), uevent_fd_.get());
+  ret = AddFd(uevent_fd_.get(), [this]() { UEventHandler(); });
+  if (ret)
+    return ret;
+
+  hotplug_timer_fd_.Set(
+      timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC));
+  if (hotplug_timer_fd_.get() < 0) {
+    ALOGE("Failed to create hotplug timer %d", -errno);
+    return -errno;
+  }
+
+  ret = AddFd(hotplug_timer_fd_.get(), [this]() { HotplugTimerHandler(); });
+  if (ret)
+    return ret;
+
+  exit_fd_.Set(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+  if (exit_fd_.get() < 0) {
+    ALOGE("Failed to create exit eventfd %d", -errno);
+    return -errno;
+  }
+
+  // Nothing to do but return to the worker, which sees it has to exit
+  ret = AddFd(exit_fd_.get(), []() {});
+  if (ret)
+    return ret;
 
   return InitWorker();
 }
 
-void DrmEventListener::RegisterHotplugHandler(DrmEventHandler *handler) {
-  assert(!hotplug_handler_);
-  hotplug_handler_.reset(handler);
+int DrmEventListener::AddFd(int fd, FdHandler handler) {
+  {
+    std::lock_guard<std::mutex> lock(handlers_lock_);
+    fd_handlers_[fd] = std::move(handler);
+  }
+
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN | EPOLLET;
+  event.data.fd = fd;
+  if (epoll_ctl(epoll_fd_.get(), EPOLL_CTL_ADD, fd, &event)) {
+    int ret = -errno;
+    ALOGE("Failed to watch fd %d %d", fd, ret);
+    std::lock_guard<std::mutex> lock(handlers_lock_);
+    fd_handlers_.erase(fd);
+    return ret;
+  }
+  return 0;
+}
+
+void DrmEventListener::RemoveFd(int fd) {
+  if (epoll_ctl(epoll_fd_.get(), EPOLL_CTL_DEL, fd, NULL))
+    ALOGE("Failed to stop watching fd %d %d", fd, -errno);
+
+  std::lock_guard<std::mutex> lock(handlers_lock_);
+  fd_handlers_.erase(fd);
+}
+
+int DrmEventListener::AddDrmDevice(DrmDevice *drm) {
+  // Reads of a drm fd only ever happen here, make them non-blocking so the
+  // handler can drain it
+  int flags = fcntl(drm->fd(), F_GETFL);
+  if (flags < 0 || fcntl(drm->fd(), F_SETFL, flags | O_NONBLOCK)) {
+    ALOGE("Failed to make drm fd non-blocking %d", -errno);
+    return -errno;
+  }
+
+  int ret = AddFd(drm->fd(), [drm]() { DrmFdHandler(drm); });
+  if (ret)
+    return ret;
+
+  VBlankDispatcher *dispatcher = drm->vblank_dispatcher();
+  ret = AddFd(dispatcher->timer_fd(),
+              [dispatcher]() { dispatcher->HandleTimeout(); });
+  if (ret)
+    RemoveFd(drm->fd());
+  return ret;
+}
+
+void DrmEventListener::RegisterHotplugHandler(
+    DrmDevice *drm, DrmHotplugEventHandler *handler) {
+  // uevents name the device by its minor number
+  struct stat st;
+  int minor = -1;
+  if (!fstat(drm->fd(), &st))
+    minor = minor(st.st_rdev);
+  else
+    ALOGW("Failed to stat drm fd %d, taking every hotplug for it", -errno);
+
+  std::lock_guard<std::mutex> lock(handlers_lock_);
+  hotplug_sources_.emplace_back();
+  HotplugSource &source = hotplug_sources_.back();
+  source.drm = drm;
+  source.minor = minor;
+  source.handler.reset(handler);
 }
 
 void DrmEventListener::FlipHandler(int /* fd */, unsigned int /* sequence */,
                                    unsigned int tv_sec, unsigned int tv_usec,
-                                   void *user_data) {
+                                   unsigned int crtc_id, void *user_data) {
   DrmEventHandler *handler = (DrmEventHandler *)user_data;
   if (!handler)
     return;
 
-  handler->HandleEvent((uint64_t)tv_sec * 1000 * 1000 + tv_usec);
-  delete handler;
+  // A commit spanning several crtcs sends an event for each of them
+  if (handler->HandleCrtcEvent(crtc_id,
+                               (uint64_t)tv_sec * 1000 * 1000 + tv_usec))
+    delete handler;
+}
+
+void DrmEventListener::VBlankHandler(int /* fd */, unsigned int sequence,
+                                     unsigned int tv_sec, unsigned int tv_usec,
+                                     void *user_data) {
+  VBlankDispatcher::HandleVBlank(sequence, tv_sec, tv_usec, user_data);
+}
+
+// static
+void DrmEventListener::DrmFdHandler(DrmDevice *drm) {
+  drmEventContext event_context = {
+      .version = 3,
+      .vblank_handler = DrmEventListener::VBlankHandler,
+      .page_flip_handler = NULL,
+      .page_flip_handler2 = DrmEventListener::FlipHandler};
+  // Each call reads as many events as fit libdrm's buffer, and fails once the
+  // fd would block
+  while (!drmHandleEvent(drm->fd(), &event_context)) {
+  }
+}
+
+void DrmEventListener::QueueHotplugLocked(const DrmUEvent &uevent,
+                                          int64_t now_ns) {
+  for (HotplugSource &source : hotplug_sources_) {
+    if (uevent.minor >= 0 && source.minor >= 0 && uevent.minor != source.minor)
+      continue;
+
+    if (!source.pending) {
+      source.pending = true;
+      source.event = DrmHotplugEvent();
+      source.event.timestamp_us = now_ns / 1000;
+    }
+
+    // Only a property changed, the connector doesn't need a re-probe
+    if (uevent.connector_id && uevent.property_id)
+      source.event.property_connectors.insert(uevent.connector_id);
+    else if (uevent.connector_id)
+      source.event.probe_connectors.insert(uevent.connector_id);
+    else
+      source.event.probe_all = true;
+  }
 }
 
 void DrmEventListener::UEventHandler() {
-  char buffer[1024];
-  int ret;
+  // Large enough for any uevent the kernel sends
+  char buffer[2048];
+  bool queued = false;
 
   struct timespec ts;
-  uint64_t timestamp = 0;
-  ret = clock_gettime(CLOCK_MONOTONIC, &ts);
-  if (!ret)
-    timestamp = ts.tv_sec * 1000 * 1000 * 1000 + ts.tv_nsec;
-  else
-    ALOGE("Failed to get monotonic clock on hotplug %d", ret);
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  int64_t now = (int64_t)ts.tv_sec * 1000 * 1000 * 1000 + ts.tv_nsec;
 
   while (true) {
-    ret = read(uevent_fd_.get(), &buffer, sizeof(buffer));
-    if (ret == 0) {
-      return;
-    } else if (ret < 0) {
-      ALOGE("Got error reading uevent %d", ret);
-      return;
+    ssize_t ret = recv(uevent_fd_.get(), buffer, sizeof(buffer), 0);
+    if (ret == 0)
+      break;
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        ALOGE("Got error reading uevent %d", -errno);
+      break;
     }
 
-    if (!hotplug_handler_)
+    DrmUEvent uevent;
+    ParseDrmUEvent(buffer, ret, &uevent);
+    if (!uevent.drm_hotplug)
       continue;
 
-    bool drm_event = false, hotplug_event = false;
-    for (int i = 0; i < ret;) {
-      char *event = buffer + i;
-      if (strcmp(event, "DEVTYPE=drm_minor"))
-        drm_event = true;
-      else if (strcmp(event, "HOTPLUG=1"))
-        hotplug_event = true;
+    std::lock_guard<std::mutex> lock(handlers_lock_);
+    QueueHotplugLocked(uevent, now);
+    queued = true;
+  }
 
-      i += strlen(event) + 1;
-    }
+  if (!queued)
+    return;
+
+  // Hold off until the burst has settled, but not forever
+  std::lock_guard<std::mutex> lock(handlers_lock_);
+  if (hotplug_burst_start_ns_ < 0)
+    hotplug_burst_start_ns_ = now;
+  int64_t deadline = std::min(now + kHotplugDebounceNs,
+                              hotplug_burst_start_ns_ + kHotplugMaxDelayNs);
+
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+  spec.it_value.tv_sec = deadline / (1000 * 1000 * 1000);
+  spec.it_value.tv_nsec = deadline % (1000 * 1000 * 1000);
+  if (timerfd_settime(hotplug_timer_fd_.get(), TFD_TIMER_ABSTIME, &spec, NULL))
+    ALOGE("Failed to arm hotplug timer %d", -errno);
+}
 
-    if (drm_event && hotplug_event)
-      hotplug_handler_->HandleEvent(timestamp);
+void DrmEventListener::HotplugTimerHandler() {
+  uint64_t expirations;
+  while (read(hotplug_timer_fd_.get(), &expirations, sizeof(expirations)) > 0) {
+  }
+
+  std::vector<std::pair<DrmHotplugEventHandler *, DrmHotplugEvent>> events;
+  {
+    std::lock_guard<std::mutex> lock(handlers_lock_);
+    hotplug_burst_start_ns_ = -1;
+    for (HotplugSource &source : hotplug_sources_) {
+      if (!source.pending)
+        continue;
+      source.pending = false;
+      events.emplace_back(source.handler.get(), std::move(source.event));
+    }
   }
+
+  // Handlers stay registered for the lifetime of the listener
+  for (auto &event : events)
+    event.first->HandleHotplug(event.second);
 }
 
 void DrmEventListener::Routine() {
+  if (stopping_) {
+    // Park until Exit() has caught up
+    Lock();
+    WaitForSignalOrExitLocked();
+    Unlock();
+    return;
+  }
+
+  struct epoll_event events[kMaxEvents];
   int ret;
   do {
-    ret = select(max_fd_ + 1, &fds_, NULL, NULL, NULL);
-  } while (ret == -1 && errno == EINTR);
+    ret = epoll_wait(epoll_fd_.get(), events, kMaxEvents, -1);
+  } while (ret < 0 && errno == EINTR);
 
-  if (FD_ISSET(drm_->fd(), &fds_)) {
-    drmEventContext event_context = {
-        .version = 2,
-        .vblank_handler = NULL,
-        .page_flip_handler = DrmEventListener::FlipHandler};
-    drmHandleEvent(drm_->fd(), &event_context);
+  if (ret < 0) {
+    ALOGE("Failed to wait for events %d", -errno);
+    return;
   }
 
-  if (FD_ISSET(uevent_fd_.get(), &fds_))
-    UEventHandler();
+  for (int i = 0; i < ret; ++i) {
+    FdHandler handler;
+    {
+      std::lock_guard<std::mutex> lock(handlers_lock_);
+      auto it = fd_handlers_.find(events[i].data.fd);
+      if (it == fd_handlers_.end())
+        continue;
+      handler = it->second;
+    }
+    handler();
+  }
 }
 }
@@ -18,8 +18,18 @@
 #define ANDROID_DRM_EVENT_LISTENER_H_
 
 #include "autofd.h"
+#include "drmuevent.h"
 #include "worker.h"
 
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sys/types.h>
+#include <vector>
+
 namespace android {
 
 class DrmDevice;
@@ -32,33 +42,100 @@ class DrmEventHandler {
   }
 
   virtual void HandleEvent(uint64_t timestamp_us) = 0;
+
+  // Called for each crtc the commit the handler was passed to touched.
+  // Returns whether the handler is done and may be deleted.
+  virtual bool HandleCrtcEvent(uint32_t /* crtc_id */, uint64_t timestamp_us) {
+    HandleEvent(timestamp_us);
+    return true;
+  }
 };
 
-class DrmEventListener : public Worker {
+// What changed on a device during a burst of hotplug uevents
+struct DrmHotplugEvent {
+  // Time of the first uevent of the burst
+  uint64_t timestamp_us = 0;
+  // Some uevent didn't name a connector, every connector needs a re-probe
+  bool probe_all = false;
+  // Connectors that need a re-probe
+  std::set<uint32_t> probe_connectors;
+  // Connectors of which only properties changed
+  std::set<uint32_t> property_connectors;
+};
+
+class DrmHotplugEventHandler {
  public:
-  DrmEventListener(DrmDevice *drm);
-  virtual ~DrmEventListener() {
+  virtual ~DrmHotplugEventHandler() {
   }
 
+  virtual void HandleHotplug(const DrmHotplugEvent &event) = 0;
+};
+
+// The single event loop of the HAL. Watches the fds of every DrmDevice, their
+// vblank timers, the uevent socket and whatever else is added through AddFd()
+// with one edge-triggered epoll set.
+class DrmEventListener : public Worker {
+ public:
+  // Called on the listener thread once fd becomes readable. Since fds are
+  // watched edge-triggered, the handler must drain fd until it would block.
+  typedef std::function<void()> FdHandler;
+
+  DrmEventListener();
+  ~DrmEventListener() override;
+
   int Init();
 
-  void RegisterHotplugHandler(DrmEventHandler *handler);
+  int AddFd(int fd, FdHandler handler);
+  void RemoveFd(int fd);
+
+  // Watches the DRM events and synthetic vblank deadlines of drm
+  int AddDrmDevice(DrmDevice *drm);
+
+  // Hands the hotplug uevents of drm to handler, which is owned by the
+  // listener from then on
+  void RegisterHotplugHandler(DrmDevice *drm, DrmHotplugEventHandler *handler);
 
   static void FlipHandler(int fd, unsigned int sequence, unsigned int tv_sec,
-                          unsigned int tv_usec, void *user_data);
+                          unsigned int tv_usec, unsigned int crtc_id,
+                          void *user_data);
+  static void VBlankHandler(int fd, unsigned int sequence, unsigned int tv_sec,
+                            unsigned int tv_usec, void *user_data);
 
  protected:
-  virtual void Routine();
+  void Routine() override;
 
  private:
+  static const int kMaxEvents = 16;
+  // Hotplug uevents are collected until none came in for this long...
+  static const int64_t kHotplugDebounceNs = 50 * 1000 * 1000;
+  // ...or the first one of the burst is this old
+  static const int64_t kHotplugMaxDelayNs = 500 * 1000 * 1000;
+
+  struct HotplugSource {
+    DrmDevice *drm;
+    int minor;
+    std::unique_ptr<DrmHotplugEventHandler> handler;
+    bool pending = false;
+    DrmHotplugEvent event;
+  };
+
+  static void DrmFdHandler(DrmDevice *drm);
   void UEventHandler();
+  void QueueHotplugLocked(const DrmUEvent &uevent, int64_t now_ns);
+  void HotplugTimerHandler();
 
-  fd_set fds_;
+  UniqueFd epoll_fd_;
   UniqueFd uevent_fd_;
-  int max_fd_ = -1;
+  UniqueFd hotplug_timer_fd_;
+  // Kicks the loop out of epoll_wait once stopping_ is set
+  UniqueFd exit_fd_;
+  std::atomic<bool> stopping_{false};
 
-  DrmDevice *drm_;
-  std::unique_ptr<DrmEventHandler> hotplug_handler_;
+  std::mutex handlers_lock_;
+  std::map<int, FdHandler> fd_handlers_;
+  std::vector<HotplugSource> hotplug_sources_;
+  // Start of the current burst of hotplug uevents, or -1
+  int64_t hotplug_burst_start_ns_ = -1;
 };
 }
 
@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "drmformattable.h"
+
+#include <algorithm>
+#include <drm/drm_fourcc.h>
+#include <drm/drm_mode.h>
+#include <errno.h>
+#include <string.h>
+
+namespace android {
+
+// Whether count elements of size bytes starting offset bytes into a length
+// byte buffer lie within it. Divides instead of multiplying, so nothing can
+// wrap whatever the width of size_t.
+static bool ArrayInBounds(size_t length, uint32_t offset, uint32_t count,
+                          size_t size) {
+  return offset <= length && count <= (length - offset) / size;
+}
+
+void DrmFormatTable::SetLinearFormats(const uint32_t *formats, size_t count) {
+  formats_.clear();
+  for (size_t i = 0; i < count; i++)
+    formats_.emplace_back(formats[i], DRM_FORMAT_MOD_LINEAR);
+  std::sort(formats_.begin(), formats_.end());
+  formats_.erase(std::unique(formats_.begin(), formats_.end()),
+                 formats_.end());
+}
+
+int DrmFormatTable::ParseInFormats(const void *data, size_t length) {
+  struct drm_format_modifier_blob header;
+  if (!data || length < sizeof(header))
+    return -EINVAL;
+  memcpy(&header, data, sizeof(header));
+
+  if (!ArrayInBounds(length, header.formats_offset, header.count_formats,
+                     sizeof(uint32_t)) ||
+      !ArrayInBounds(length, header.modifiers_offset, header.count_modifiers,
+                     sizeof(struct drm_format_modifier)))
+    return -EINVAL;
+
+  // The kernel aligns the arrays, but nothing says a blob has to be
+  const char *bytes = (const char *)data;
+  std::vector<uint32_t> formats(header.count_formats);
+  if (!formats.empty())
+    memcpy(formats.data(), bytes + header.formats_offset,
+           formats.size() * sizeof(uint32_t));
+
+  std::vector<std::pair<uint32_t, uint64_t>> in_formats;
+  for (uint32_t i = 0; i < header.count_modifiers; i++) {
+    struct drm_format_modifier modifier;
+    memcpy(&modifier, bytes + header.modifiers_offset + i * sizeof(modifier),
+           sizeof(modifier));
+    // Each modifier applies to a 64 format window starting at offset
+    for (uint32_t j = 0; j < 64; j++) {
+      uint64_t format_index = (uint64_t)modifier.offset + j;
+      if (!(modifier.formats & (1ULL << j)) ||
+          format_index >= header.count_formats)
+        continue;
+      in_formats.emplace_back(formats[format_index], modifier.modifier);
+    }
+  }
+
+  // Formats without an explicit modifier are implicitly linear
+  if (!header.count_modifiers)
+    for (uint32_t format : formats)
+      in_formats.emplace_back(format, DRM_FORMAT_MOD_LINEAR);
+
+  std::sort(in_formats.begin(), in_formats.end());
+  in_formats.erase(std::unique(in_formats.begin(), in_formats.end()),
+                   in_formats.end());
+  formats_.swap(in_formats);
+  return 0;
+}
+
+bool DrmFormatTable::Supports(uint32_t fourcc, uint64_t modifier) const {
+  if (modifier == DRM_FORMAT_MOD_INVALID) {
+    auto it = std::lower_bound(formats_.begin(), formats_.end(),
+                               std::make_pair(fourcc, (uint64_t)0));
+    return it != formats_.end() && it->first == fourcc;
+  }
+  return std::binary_search(formats_.begin(), formats_.end(),
+                            std::make_pair(fourcc, modifier));
+}
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef ANDROID_DRM_FORMAT_TABLE_H_
+#define ANDROID_DRM_FORMAT_TABLE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+namespace android {
+
+// The (fourcc, modifier) pairs a plane can scan out, kept sorted for binary
+// searching
+class DrmFormatTable {
+ public:
+  // Replaces the table with formats, all of them linear, as listed by the
+  // legacy plane format list
+  void SetLinearFormats(const uint32_t *formats, size_t count);
+
+  // Replaces the table with the contents of a struct drm_format_modifier_blob
+  // of length bytes, as found in a plane's IN_FORMATS property. Returns
+  // -EINVAL and leaves the table alone if the blob is truncated or points
+  // outside of itself.
+  int ParseInFormats(const void *data, size_t length);
+
+  // Whether the table holds fourcc with modifier. DRM_FORMAT_MOD_INVALID
+  // matches any modifier listed with fourcc.
+  bool Supports(uint32_t fourcc, uint64_t modifier) const;
+
+ private:
+  std::vector<std::pair<uint32_t, uint64_t>> formats_;
+};
+}
+
+#endif  // ANDROID_DRM_FORMAT_TABLE_H_
@@ -23,10 +23,14 @@ typedef struct hwc_drm_bo {
   uint32_t width;
   uint32_t height;
   uint32_t format; /* DRM_FORMAT_* from drm_fourcc.h */
+  uint32_t hal_format; /* HAL_PIXEL_FORMAT_* the buffer was allocated with */
   uint32_t usage;
+  uint32_t pixel_stride;
+  uint32_t layer_count;
   uint32_t pitches[4];
   uint32_t offsets[4];
   uint32_t gem_handles[4];
+  uint64_t modifiers[4]; /* DRM_FORMAT_MOD_* of each plane */
   uint32_t fb_id;
   int acquire_fence_fd;
   void *priv;
@@ -20,6 +20,8 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include <list>
+#include <memory>
 #include <vector>
 
 #include <hardware/hardware.h>
@@ -41,30 +43,19 @@ namespace android {
 
 class Importer;
 
+// An imported buffer object. Share() hands out further references to the same
+// import, which is released along with the last of them.
 class DrmHwcBuffer {
  public:
   DrmHwcBuffer() = default;
   DrmHwcBuffer(const hwc_drm_bo &bo, Importer *importer)
-      : bo_(bo), importer_(importer) {
-  }
-  DrmHwcBuffer(DrmHwcBuffer &&rhs) : bo_(rhs.bo_), importer_(rhs.importer_) {
-    rhs.importer_ = NULL;
-  }
-
-  ~DrmHwcBuffer() {
-    Clear();
-  }
-
-  DrmHwcBuffer &operator=(DrmHwcBuffer &&rhs) {
-    Clear();
-    importer_ = rhs.importer_;
-    rhs.importer_ = NULL;
-    bo_ = rhs.bo_;
-    return *this;
+      : import_(std::make_shared<Import>(bo, importer)) {
   }
+  DrmHwcBuffer(DrmHwcBuffer &&rhs) = default;
+  DrmHwcBuffer &operator=(DrmHwcBuffer &&rhs) = default;
 
   operator bool() const {
-    return importer_ != NULL;
+    return import_ != NULL;
   }
 
   const hwc_drm_bo *operator->() const;
@@ -73,9 +64,23 @@ class DrmHwcBuffer {
 
   int ImportBuffer(buffer_handle_t handle, Importer *importer);
 
+  DrmHwcBuffer Share() const {
+    DrmHwcBuffer buffer;
+    buffer.import_ = import_;
+    return buffer;
+  }
+
  private:
-  hwc_drm_bo bo_;
-  Importer *importer_ = NULL;
+  struct Import {
+    Import(const hwc_drm_bo &b, Importer *i) : bo(b), importer(i) {
+    }
+    ~Import();
+
+    hwc_drm_bo bo;
+    Importer *importer;
+  };
+
+  std::shared_ptr<Import> import_;
 };
 
 class DrmHwcNativeHandle {
@@ -112,6 +117,34 @@ class DrmHwcNativeHandle {
   native_handle_t *handle_ = NULL;
 };
 
+// Remembers the gralloc imported copies of the buffers recently presented on a
+// layer. Buffers cycle through the few slots of a layer's BufferQueue, so this
+// saves a gralloc import/free round trip for almost every frame.
+class DrmHwcNativeHandleCache {
+ public:
+  std::shared_ptr<DrmHwcNativeHandle> Get(buffer_handle_t handle);
+  void Put(buffer_handle_t handle, std::shared_ptr<DrmHwcNativeHandle> copy);
+
+  void Clear() {
+    entries_.clear();
+  }
+
+ private:
+  // Larger than the deepest BufferQueue we expect to see on a layer
+  static const size_t kMaxEntries = 8;
+
+  struct Entry {
+    buffer_handle_t handle;
+    // Identity of the first fd in the handle. A freed handle can be
+    // reallocated at the same address, this tells the new buffer apart.
+    std::pair<dev_t, ino_t> id;
+    std::shared_ptr<DrmHwcNativeHandle> copy;
+  };
+
+  // Most recently used first
+  std::list<Entry> entries_;
+};
+
 enum DrmHwcTransform {
   kIdentity = 0,
   kFlipH = 1 << 0,
@@ -131,7 +164,7 @@ struct DrmHwcLayer {
   buffer_handle_t sf_handle = NULL;
   int gralloc_buffer_usage = 0;
   DrmHwcBuffer buffer;
-  DrmHwcNativeHandle handle;
+  std::shared_ptr<DrmHwcNativeHandle> handle;
   uint32_t transform;
   DrmHwcBlending blending = DrmHwcBlending::kNone;
   uint16_t alpha = 0xffff;
@@ -139,9 +172,11 @@ struct DrmHwcLayer {
   hwc_rect_t display_frame;
 
   UniqueFd acquire_fence;
-  OutputFd release_fence;
 
-  int ImportBuffer(Importer *importer);
+  int ImportBuffer(Importer *importer,
+                   DrmHwcNativeHandleCache *handle_cache = NULL);
+  // Finishes the import of a layer whose buffer was already imported
+  int ImportHandle(DrmHwcNativeHandleCache *handle_cache = NULL);
   int InitFromDrmHwcLayer(DrmHwcLayer *layer, Importer *importer);
 
   void SetTransform(int32_t sf_transform);
@@ -149,7 +184,7 @@ struct DrmHwcLayer {
   void SetDisplayFrame(hwc_rect_t const &frame);
 
   buffer_handle_t get_usable_handle() const {
-    return handle.get() != NULL ? handle.get() : sf_handle;
+    return handle && handle->get() != NULL ? handle->get() : sf_handle;
   }
 
   bool protected_usage() const {
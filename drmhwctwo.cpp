@@ -21,9 +21,11 @@
 #include "drmhwcomposer.h"
 #include "drmhwctwo.h"
 #include "platform.h"
-#include "vsyncworker.h"
+#include "vblankdispatcher.h"
 
+#include <algorithm>
 #include <inttypes.h>
+#include <set>
 #include <string>
 
 #include <log/log.h>
@@ -95,7 +97,8 @@ HWC2::Error DrmHwcTwo::Init() {
 
   auto &drmDevices = resource_manager_.getDrmDevices();
   for (auto &device : drmDevices) {
-    device->RegisterHotplugHandler(new DrmHotplugHandler(this, device.get()));
+    resource_manager_.event_listener()->RegisterHotplugHandler(
+        device.get(), new DrmHotplugHandler(this, device.get()));
   }
   return ret;
 }
@@ -123,8 +126,22 @@ HWC2::Error DrmHwcTwo::DestroyVirtualDisplay(hwc2_display_t display) {
 }
 
 void DrmHwcTwo::Dump(uint32_t *size, char *buffer) {
-  // TODO: Implement dump
-  unsupported(__func__, size, buffer);
+  supported(__func__);
+
+  // SurfaceFlinger first asks for the size, then for the contents
+  if (buffer) {
+    *size = std::min(*size, (uint32_t)dump_string_.size());
+    memcpy(buffer, dump_string_.data(), *size);
+    return;
+  }
+
+  std::ostringstream out;
+  for (auto &display : displays_)
+    display.second.Dump(&out);
+  for (auto &drm : resource_manager_.getDrmDevices())
+    drm->commit_aggregator()->Dump(&out);
+  dump_string_ = out.str();
+  *size = dump_string_.size();
 }
 
 uint32_t DrmHwcTwo::GetMaxVirtualDisplayCount() {
@@ -218,9 +235,9 @@ HWC2::Error DrmHwcTwo::HwcDisplay::Init(std::vector<DrmPlane *> *planes) {
     return HWC2::Error::BadDisplay;
   }
 
-  ret = vsync_worker_.Init(drm_, display);
+  ret = import_worker_.Init(importer_, display);
   if (ret) {
-    ALOGE("Failed to create event worker for d=%d %d\n", display, ret);
+    ALOGE("Failed to create import worker for d=%d %d\n", display, ret);
     return HWC2::Error::BadDisplay;
   }
 
@@ -247,11 +264,36 @@ HWC2::Error DrmHwcTwo::HwcDisplay::ChosePrefferedConfig() {
 HWC2::Error DrmHwcTwo::HwcDisplay::RegisterVsyncCallback(
     hwc2_callback_data_t data, hwc2_function_pointer_t func) {
   supported(__func__);
-  auto callback = std::make_shared<DrmVsyncCallback>(data, func);
-  vsync_worker_.RegisterCallback(std::move(callback));
+  VBlankDispatcher *dispatcher = drm_->vblank_dispatcher();
+  if (vsync_callback_)
+    dispatcher->UnregisterCallback(vsync_callback_);
+  vsync_callback_ = std::make_shared<DrmVsyncCallback>(data, func);
+  dispatcher->RegisterCallback(static_cast<int>(handle_), vsync_callback_);
+  UpdateVsync();
   return HWC2::Error::None;
 }
 
+void DrmHwcTwo::HwcDisplay::GetRefreshRange(float *min_hz, float *max_hz) {
+  *min_hz = *max_hz = connector_->active_mode().v_refresh();
+
+  float vrr_min_hz, vrr_max_hz;
+  if (connector_->vrr_active() &&
+      connector_->GetRefreshRange(&vrr_min_hz, &vrr_max_hz) &&
+      vrr_min_hz < *max_hz) {
+    *min_hz = vrr_min_hz;
+    *max_hz = std::min(*max_hz, vrr_max_hz);
+  }
+}
+
+void DrmHwcTwo::HwcDisplay::Dump(std::ostringstream *out) {
+  float min_hz, max_hz;
+  GetRefreshRange(&min_hz, &max_hz);
+  *out << "--HwcDisplay[" << handle_ << "]: refresh=" << min_hz << "-"
+       << max_hz << "Hz vrr=" << connector_->vrr_active() << "\n";
+  compositor_.Dump(out);
+  import_worker_.Dump(out);
+}
+
 HWC2::Error DrmHwcTwo::HwcDisplay::AcceptDisplayChanges() {
   supported(__func__);
   for (std::pair<const hwc2_layer_t, DrmHwcTwo::HwcLayer> &l : layers_)
@@ -261,7 +303,10 @@ HWC2::Error DrmHwcTwo::HwcDisplay::AcceptDisplayChanges() {
 
 HWC2::Error DrmHwcTwo::HwcDisplay::CreateLayer(hwc2_layer_t *layer) {
   supported(__func__);
-  layers_.emplace(static_cast<hwc2_layer_t>(layer_idx_), HwcLayer());
+  auto new_layer =
+      layers_.emplace(static_cast<hwc2_layer_t>(layer_idx_), HwcLayer()).first;
+  new_layer->second.set_import_worker(&import_worker_);
+  layers_changed_ = true;
   *layer = static_cast<hwc2_layer_t>(layer_idx_);
   ++layer_idx_;
   return HWC2::Error::None;
@@ -269,7 +314,10 @@ HWC2::Error DrmHwcTwo::HwcDisplay::CreateLayer(hwc2_layer_t *layer) {
 
 HWC2::Error DrmHwcTwo::HwcDisplay::DestroyLayer(hwc2_layer_t layer) {
   supported(__func__);
+  // SurfaceFlinger may free the layer's buffers once it is gone
+  import_worker_.Flush();
   layers_.erase(layer);
+  layers_changed_ = true;
   return HWC2::Error::None;
 }
 
@@ -445,7 +493,7 @@ HWC2::Error DrmHwcTwo::HwcDisplay::GetDisplayType(int32_t *type) {
 
 HWC2::Error DrmHwcTwo::HwcDisplay::GetDozeSupport(int32_t *support) {
   supported(__func__);
-  *support = 0;
+  *support = 1;
   return HWC2::Error::None;
 }
 
@@ -498,18 +546,41 @@ HWC2::Error DrmHwcTwo::HwcDisplay::CreateComposition(bool test) {
   DrmCompositionDisplayLayersMap &map = layers_map.back();
 
   map.display = static_cast<int>(handle_);
-  map.geometry_changed = true;  // TODO: Fix this
+  map.geometry_changed = layers_changed_;
 
   // order the layers by z-order
   bool use_client_layer = false;
   uint32_t client_z_order = UINT32_MAX;
   std::map<uint32_t, DrmHwcTwo::HwcLayer *> z_map;
+
+  // Only the top device layers that ValidateDisplay can leave on planes are
+  // tested, the ones below end up in the client target
+  std::set<DrmHwcTwo::HwcLayer *> tested_layers;
+  if (test) {
+    std::map<uint32_t, DrmHwcTwo::HwcLayer *, std::greater<int>> device_z_map;
+    for (std::pair<const hwc2_layer_t, DrmHwcTwo::HwcLayer> &l : layers_) {
+      l.second.set_planned(false);
+      if (l.second.sf_type() == HWC2::Composition::Device)
+        device_z_map.emplace(std::make_pair(l.second.z_order(), &l.second));
+    }
+    size_t budget = DevicePlaneBudget();
+    for (std::pair<const uint32_t, DrmHwcTwo::HwcLayer *> &l : device_z_map) {
+      if (!budget--)
+        break;
+      tested_layers.insert(l.second);
+    }
+  }
+
   for (std::pair<const hwc2_layer_t, DrmHwcTwo::HwcLayer> &l : layers_) {
     HWC2::Composition comp_type;
-    if (test)
-      comp_type = l.second.sf_type();
-    else
+    if (!test)
       comp_type = l.second.validated_type();
+    else if (tested_layers.count(&l.second))
+      comp_type = HWC2::Composition::Device;
+    else if (l.second.sf_type() == HWC2::Composition::Device)
+      comp_type = HWC2::Composition::Client;
+    else
+      comp_type = l.second.sf_type();
 
     switch (comp_type) {
       case HWC2::Composition::Device:
@@ -534,20 +605,31 @@ HWC2::Error DrmHwcTwo::HwcDisplay::CreateComposition(bool test) {
   for (std::pair<const uint32_t, DrmHwcTwo::HwcLayer *> &l : z_map) {
     DrmHwcLayer layer;
     l.second->PopulateDrmLayer(&layer);
-    int ret = layer.ImportBuffer(importer_.get());
+    int ret = import_worker_.TakeBuffer(layer.sf_handle, &layer.buffer);
+    if (!ret)
+      ret = layer.ImportHandle(l.second->handle_cache());
     if (ret) {
       ALOGE("Failed to import layer, ret=%d", ret);
       return HWC2::Error::NoResources;
     }
+    l.second->UpdateBufferGeometry(layer.buffer.operator->());
     map.layers.emplace_back(std::move(layer));
   }
 
+  // A layer moving between a plane and the client target changes the plane
+  // assignment just as much as one that stays on a plane, and so does the
+  // client target coming or going
+  for (std::pair<const hwc2_layer_t, DrmHwcTwo::HwcLayer> &l : layers_)
+    map.geometry_changed |= l.second.geometry_changed();
+  map.geometry_changed |= client_layer_.geometry_changed() ||
+                          use_client_layer != client_target_presented_;
+
   std::unique_ptr<DrmDisplayComposition> composition =
       compositor_.CreateComposition();
   composition->Init(drm_, crtc_, importer_.get(), planner_.get(), frame_no_);
 
-  // TODO: Don't always assume geometry changed
-  int ret = composition->SetLayers(map.layers.data(), map.layers.size(), true);
+  int ret = composition->SetLayers(map.layers.data(), map.layers.size(),
+                                   map.geometry_changed);
   if (ret) {
     ALOGE("Failed to set layers in the composition ret=%d", ret);
     return HWC2::Error::BadLayer;
@@ -561,6 +643,23 @@ HWC2::Error DrmHwcTwo::HwcDisplay::CreateComposition(bool test) {
     return HWC2::Error::BadConfig;
   }
 
+  const std::vector<size_t> &unplaced = composition->unplaced_layers();
+  if (!test && !unplaced.empty()) {
+    ALOGE("Failed to place %zu validated layers", unplaced.size());
+    return HWC2::Error::BadConfig;
+  }
+  if (test) {
+    size_t index = 0;
+    for (std::pair<const uint32_t, DrmHwcTwo::HwcLayer *> &l : z_map) {
+      bool planned = std::find(unplaced.begin(), unplaced.end(), index++) ==
+                     unplaced.end();
+      // Without a plane for the client target nothing can be validated
+      if (l.second == &client_layer_ && !planned)
+        return HWC2::Error::BadConfig;
+      l.second->set_planned(planned);
+    }
+  }
+
   // Disable the planes we're not using
   for (auto i = primary_planes.begin(); i != primary_planes.end();) {
     composition->AddPlaneDisable(*i);
@@ -574,14 +673,34 @@ HWC2::Error DrmHwcTwo::HwcDisplay::CreateComposition(bool test) {
   if (test) {
     ret = compositor_.TestComposition(composition.get());
   } else {
-    AddFenceToRetireFence(composition->take_out_fence());
-    ret = compositor_.ApplyComposition(std::move(composition));
+    int present_fence = -1;
+    ret = compositor_.QueueComposition(std::move(composition), &present_fence);
+    AddFenceToRetireFence(present_fence);
+    // Once this frame is on screen the buffers of the previous one, whatever
+    // layer they belonged to, are released
+    if (!ret) {
+      for (std::pair<const hwc2_layer_t, DrmHwcTwo::HwcLayer> &l : layers_)
+        l.second.set_release_fence(present_fence >= 0 ? dup(present_fence)
+                                                      : -1);
+    }
+    if (present_fence >= 0)
+      close(present_fence);
   }
   if (ret) {
     if (!test)
       ALOGE("Failed to apply the frame composition ret=%d", ret);
     return HWC2::Error::BadParameter;
   }
+
+  if (!test) {
+    // The kernel accepted this geometry, until it changes again there is no
+    // need to test it before committing
+    layers_changed_ = false;
+    for (std::pair<const hwc2_layer_t, DrmHwcTwo::HwcLayer> &l : layers_)
+      l.second.set_presented();
+    client_layer_.set_presented();
+    client_target_presented_ = use_client_layer;
+  }
   return HWC2::Error::None;
 }
 
@@ -590,6 +709,8 @@ HWC2::Error DrmHwcTwo::HwcDisplay::PresentDisplay(int32_t *retire_fence) {
   HWC2::Error ret;
 
   ret = CreateComposition(false);
+  // Imports not picked up by now are for buffers SurfaceFlinger may free
+  import_worker_.Flush();
   if (ret == HWC2::Error::BadLayer) {
     // Can we really have no client or device layers?
     *retire_fence = -1;
@@ -622,6 +743,7 @@ HWC2::Error DrmHwcTwo::HwcDisplay::SetActiveConfig(hwc2_config_t config) {
   composition->Init(drm_, crtc_, importer_.get(), planner_.get(), frame_no_);
   int ret = composition->SetDisplayMode(*mode);
   ret = compositor_.ApplyComposition(std::move(composition));
+  layers_changed_ = true;
   if (ret) {
     ALOGE("Failed to queue dpms composition on %d", ret);
     return HWC2::Error::BadConfig;
@@ -653,6 +775,7 @@ HWC2::Error DrmHwcTwo::HwcDisplay::SetClientTarget(buffer_handle_t target,
 
   client_layer_.set_buffer(target);
   client_layer_.set_acquire_fence(uf.get());
+  import_worker_.QueueImport(target);
   client_layer_.SetLayerDataspace(dataspace);
   return HWC2::Error::None;
 }
@@ -685,10 +808,19 @@ HWC2::Error DrmHwcTwo::HwcDisplay::SetPowerMode(int32_t mode_in) {
   supported(__func__);
   uint64_t dpms_value = 0;
   auto mode = static_cast<HWC2::PowerMode>(mode_in);
+  // There is no generic low power state for a crtc, so the doze modes keep
+  // the last frame on screen and only stop the work behind it. STANDBY still
+  // takes frames, SUSPEND doesn't expect any.
   switch (mode) {
     case HWC2::PowerMode::Off:
       dpms_value = DRM_MODE_DPMS_OFF;
       break;
+    case HWC2::PowerMode::DozeSuspend:
+      dpms_value = DRM_MODE_DPMS_SUSPEND;
+      break;
+    case HWC2::PowerMode::Doze:
+      dpms_value = DRM_MODE_DPMS_STANDBY;
+      break;
     case HWC2::PowerMode::On:
       dpms_value = DRM_MODE_DPMS_ON;
       break;
@@ -706,15 +838,45 @@ HWC2::Error DrmHwcTwo::HwcDisplay::SetPowerMode(int32_t mode_in) {
     ALOGE("Failed to apply the dpms composition ret=%d", ret);
     return HWC2::Error::BadParameter;
   }
+  power_mode_ = mode;
+  UpdateVsync();
+  layers_changed_ = true;
   return HWC2::Error::None;
 }
 
+void DrmHwcTwo::HwcDisplay::UpdateVsync() {
+  // Nothing is drawn while suspended, don't keep the vblank interrupt going
+  if (vsync_callback_)
+    drm_->vblank_dispatcher()->VSyncControl(
+        vsync_callback_,
+        vsync_enabled_ && power_mode_ != HWC2::PowerMode::DozeSuspend);
+}
+
 HWC2::Error DrmHwcTwo::HwcDisplay::SetVsyncEnabled(int32_t enabled) {
   supported(__func__);
-  vsync_worker_.VSyncControl(HWC2_VSYNC_ENABLE == enabled);
+  vsync_enabled_ = HWC2_VSYNC_ENABLE == enabled;
+  UpdateVsync();
   return HWC2::Error::None;
 }
 
+size_t DrmHwcTwo::HwcDisplay::DevicePlaneBudget() {
+  size_t avail_planes = primary_planes_.size() + overlay_planes_.size();
+  size_t device_layers = 0;
+  for (std::pair<const hwc2_layer_t, DrmHwcTwo::HwcLayer> &l : layers_) {
+    if (l.second.sf_type() == HWC2::Composition::Device)
+      ++device_layers;
+  }
+
+  /*
+   * If any layer is left to the client, save one plane
+   * for the client target
+   */
+  if (avail_planes && (device_layers < layers_.size() ||
+                       device_layers > avail_planes))
+    avail_planes--;
+  return avail_planes;
+}
+
 HWC2::Error DrmHwcTwo::HwcDisplay::ValidateDisplay(uint32_t *num_types,
                                                    uint32_t *num_requests) {
   supported(__func__);
@@ -746,15 +908,10 @@ HWC2::Error DrmHwcTwo::HwcDisplay::ValidateDisplay(uint32_t *num_types,
       z_map.emplace(std::make_pair(l.second.z_order(), &l.second));
   }
 
-  /*
-   * If more layers then planes, save one plane
-   * for client composited layers
-   */
-  if (avail_planes < layers_.size())
-    avail_planes--;
-
+  // Planes are stacked bottom up, once a layer couldn't get one all layers
+  // below it go to the client target as well
   for (std::pair<const uint32_t, DrmHwcTwo::HwcLayer *> &l : z_map) {
-    if (comp_failed || !avail_planes--)
+    if (comp_failed || !l.second->planned())
       break;
     l.second->set_validated_type(HWC2::Composition::Device);
   }
@@ -787,6 +944,8 @@ HWC2::Error DrmHwcTwo::HwcLayer::SetCursorPosition(int32_t x, int32_t y) {
 
 HWC2::Error DrmHwcTwo::HwcLayer::SetLayerBlendMode(int32_t mode) {
   supported(__func__);
+  if (blending_ != static_cast<HWC2::BlendMode>(mode))
+    dirty_ |= kDirtyBlending;
   blending_ = static_cast<HWC2::BlendMode>(mode);
   return HWC2::Error::None;
 }
@@ -802,6 +961,9 @@ HWC2::Error DrmHwcTwo::HwcLayer::SetLayerBuffer(buffer_handle_t buffer,
       sf_type_ == HWC2::Composition::SolidColor)
     return HWC2::Error::None;
 
+  if (buffer != buffer_ && import_worker_)
+    import_worker_->QueueImport(buffer);
+
   set_buffer(buffer);
   set_acquire_fence(uf.get());
   return HWC2::Error::None;
@@ -825,12 +987,18 @@ HWC2::Error DrmHwcTwo::HwcLayer::SetLayerDataspace(int32_t dataspace) {
 
 HWC2::Error DrmHwcTwo::HwcLayer::SetLayerDisplayFrame(hwc_rect_t frame) {
   supported(__func__);
+  if (frame.left != display_frame_.left || frame.top != display_frame_.top ||
+      frame.right != display_frame_.right ||
+      frame.bottom != display_frame_.bottom)
+    dirty_ |= kDirtyDisplayFrame;
   display_frame_ = frame;
   return HWC2::Error::None;
 }
 
 HWC2::Error DrmHwcTwo::HwcLayer::SetLayerPlaneAlpha(float alpha) {
   supported(__func__);
+  if (alpha != alpha_)
+    dirty_ |= kDirtyAlpha;
   alpha_ = alpha;
   return HWC2::Error::None;
 }
@@ -844,6 +1012,9 @@ HWC2::Error DrmHwcTwo::HwcLayer::SetLayerSidebandStream(
 
 HWC2::Error DrmHwcTwo::HwcLayer::SetLayerSourceCrop(hwc_frect_t crop) {
   supported(__func__);
+  if (crop.left != source_crop_.left || crop.top != source_crop_.top ||
+      crop.right != source_crop_.right || crop.bottom != source_crop_.bottom)
+    dirty_ |= kDirtySourceCrop;
   source_crop_ = crop;
   return HWC2::Error::None;
 }
@@ -857,6 +1028,8 @@ HWC2::Error DrmHwcTwo::HwcLayer::SetLayerSurfaceDamage(hwc_region_t damage) {
 
 HWC2::Error DrmHwcTwo::HwcLayer::SetLayerTransform(int32_t transform) {
   supported(__func__);
+  if (transform_ != static_cast<HWC2::Transform>(transform))
+    dirty_ |= kDirtyTransform;
   transform_ = static_cast<HWC2::Transform>(transform);
   return HWC2::Error::None;
 }
@@ -870,10 +1043,22 @@ HWC2::Error DrmHwcTwo::HwcLayer::SetLayerVisibleRegion(hwc_region_t visible) {
 
 HWC2::Error DrmHwcTwo::HwcLayer::SetLayerZOrder(uint32_t order) {
   supported(__func__);
+  if (z_order_ != order)
+    dirty_ |= kDirtyZOrder;
   z_order_ = order;
   return HWC2::Error::None;
 }
 
+void DrmHwcTwo::HwcLayer::UpdateBufferGeometry(const hwc_drm_bo *bo) {
+  if (bo->width != buffer_width_ || bo->height != buffer_height_ ||
+      bo->format != buffer_format_ || bo->modifiers[0] != buffer_modifier_)
+    dirty_ |= kDirtyBufferGeometry;
+  buffer_width_ = bo->width;
+  buffer_height_ = bo->height;
+  buffer_format_ = bo->format;
+  buffer_modifier_ = bo->modifiers[0];
+}
+
 void DrmHwcTwo::HwcLayer::PopulateDrmLayer(DrmHwcLayer *layer) {
   supported(__func__);
   switch (blending_) {
@@ -892,11 +1077,8 @@ void DrmHwcTwo::HwcLayer::PopulateDrmLayer(DrmHwcLayer *layer) {
       break;
   }
 
-  OutputFd release_fence = release_fence_output();
-
   layer->sf_handle = buffer_;
   layer->acquire_fence = acquire_fence_.Release();
-  layer->release_fence = std::move(release_fence);
   layer->SetDisplayFrame(display_frame_);
   layer->alpha = static_cast<uint16_t>(65535.0f * alpha_ + 0.5f);
   layer->SetSourceCrop(source_crop_);
@@ -932,18 +1114,28 @@ void DrmHwcTwo::handleInitialHotplugState(DrmDevice *drmDevice) {
   }
 }
 
-void DrmHwcTwo::DrmHotplugHandler::HandleEvent(uint64_t timestamp_us) {
+void DrmHwcTwo::DrmHotplugHandler::HandleHotplug(
+    const DrmHotplugEvent &event) {
   for (auto &conn : drm_->connectors()) {
+    if (event.property_connectors.count(conn->id()))
+      drm_->RefreshProperties(conn->id(), DRM_MODE_OBJECT_CONNECTOR);
+
+    // Re-probing reads the EDID, leave the connectors that didn't change be
+    if (!event.probe_all && !event.probe_connectors.count(conn->id()))
+      continue;
+
     drmModeConnection old_state = conn->state();
     drmModeConnection cur_state =
-        (conn->UpdateModes()) ? DRM_MODE_UNKNOWNCONNECTION : conn->state();
+        (conn->UpdateModes(true)) ? DRM_MODE_UNKNOWNCONNECTION : conn->state();
+    // A new sink brings its own properties, vrr_capable among them
+    drm_->RefreshProperties(conn->id(), DRM_MODE_OBJECT_CONNECTOR);
 
     if (cur_state == old_state)
       continue;
 
     ALOGI("%s event @%" PRIu64 " for connector %u\n",
-          cur_state == DRM_MODE_CONNECTED ? "Plug" : "Unplug", timestamp_us,
-          conn->id());
+          cur_state == DRM_MODE_CONNECTED ? "Plug" : "Unplug",
+          event.timestamp_us, conn->id());
 
     if (conn->display() != HWC_DISPLAY_EXTERNAL)
       continue;
@@ -16,13 +16,16 @@
 
 #include "drmdisplaycompositor.h"
 #include "drmhwcomposer.h"
+#include "importworker.h"
 #include "platform.h"
 #include "resourcemanager.h"
-#include "vsyncworker.h"
+#include "vblankdispatcher.h"
 
 #include <hardware/hwcomposer2.h>
 
 #include <map>
+#include <sstream>
+#include <string>
 
 namespace android {
 
@@ -53,6 +56,13 @@ class DrmHwcTwo : public hwc2_device_t {
     bool type_changed() const {
       return sf_type_ != validated_type_;
     }
+    // Whether the last test composition found a plane for the layer
+    bool planned() const {
+      return planned_;
+    }
+    void set_planned(bool planned) {
+      planned_ = planned;
+    }
 
     uint32_t z_order() const {
       return z_order_;
@@ -78,13 +88,28 @@ class DrmHwcTwo : public hwc2_device_t {
     int take_release_fence() {
       return release_fence_.Release();
     }
-    void manage_release_fence() {
-      release_fence_.Set(release_fence_raw_);
-      release_fence_raw_ = -1;
+    void set_release_fence(int release_fence) {
+      release_fence_.Set(release_fence);
+    }
+
+    DrmHwcNativeHandleCache *handle_cache() {
+      return &handle_cache_;
+    }
+
+    void set_import_worker(ImportWorker *import_worker) {
+      import_worker_ = import_worker;
+    }
+
+    // Whether anything but the buffer contents changed since the layer was
+    // last presented
+    bool geometry_changed() const {
+      return dirty_ != 0 || validated_type_ != presented_type_;
     }
-    OutputFd release_fence_output() {
-      return OutputFd(&release_fence_raw_);
+    void set_presented() {
+      dirty_ = 0;
+      presented_type_ = validated_type_;
     }
+    void UpdateBufferGeometry(const hwc_drm_bo *bo);
 
     void PopulateDrmLayer(DrmHwcLayer *layer);
 
@@ -109,11 +134,11 @@ class DrmHwcTwo : public hwc2_device_t {
     // validated_type_ stores the type after running ValidateDisplay
     HWC2::Composition sf_type_ = HWC2::Composition::Invalid;
     HWC2::Composition validated_type_ = HWC2::Composition::Invalid;
+    bool planned_ = false;
 
     HWC2::BlendMode blending_ = HWC2::BlendMode::None;
-    buffer_handle_t buffer_;
+    buffer_handle_t buffer_ = NULL;
     UniqueFd acquire_fence_;
-    int release_fence_raw_ = -1;
     UniqueFd release_fence_;
     hwc_rect_t display_frame_;
     float alpha_ = 1.0f;
@@ -123,6 +148,26 @@ class DrmHwcTwo : public hwc2_device_t {
     HWC2::Transform transform_ = HWC2::Transform::None;
     uint32_t z_order_ = 0;
     android_dataspace_t dataspace_ = HAL_DATASPACE_UNKNOWN;
+    DrmHwcNativeHandleCache handle_cache_;
+    ImportWorker *import_worker_ = NULL;
+
+    enum DirtyBits : uint32_t {
+      kDirtyDisplayFrame = 1 << 0,
+      kDirtySourceCrop = 1 << 1,
+      kDirtyTransform = 1 << 2,
+      kDirtyBlending = 1 << 3,
+      kDirtyAlpha = 1 << 4,
+      kDirtyZOrder = 1 << 5,
+      kDirtyBufferGeometry = 1 << 6,
+      kDirtyAll = (1 << 7) - 1,
+    };
+    uint32_t dirty_ = kDirtyAll;
+    HWC2::Composition presented_type_ = HWC2::Composition::Invalid;
+    // Size and layout of the last buffer, a change needs a new atomic test
+    uint32_t buffer_width_ = 0;
+    uint32_t buffer_height_ = 0;
+    uint32_t buffer_format_ = 0;
+    uint64_t buffer_modifier_ = 0;
   };
 
   struct HwcCallback {
@@ -144,6 +189,11 @@ class DrmHwcTwo : public hwc2_device_t {
     HWC2::Error RegisterVsyncCallback(hwc2_callback_data_t data,
                                       hwc2_function_pointer_t func);
     void ClearDisplay();
+    void Dump(std::ostringstream *out);
+
+    // Range of refresh rates the display presents at. Only wider than the
+    // active config's rate while variable refresh rate is in use.
+    void GetRefreshRange(float *min_hz, float *max_hz);
 
     // HWC Hooks
     HWC2::Error AcceptDisplayChanges();
@@ -189,7 +239,9 @@ class DrmHwcTwo : public hwc2_device_t {
 
    private:
     HWC2::Error CreateComposition(bool test);
+    size_t DevicePlaneBudget();
     void AddFenceToRetireFence(int fd);
+    void UpdateVsync();
 
     ResourceManager *resource_manager_;
     DrmDevice *drm_;
@@ -200,14 +252,21 @@ class DrmHwcTwo : public hwc2_device_t {
     std::vector<DrmPlane *> primary_planes_;
     std::vector<DrmPlane *> overlay_planes_;
 
-    VSyncWorker vsync_worker_;
+    std::shared_ptr<VsyncCallback> vsync_callback_;
+    bool vsync_enabled_ = false;
+    HWC2::PowerMode power_mode_ = HWC2::PowerMode::Off;
+    ImportWorker import_worker_;
     DrmConnector *connector_ = NULL;
     DrmCrtc *crtc_ = NULL;
     hwc2_display_t handle_;
     HWC2::DisplayType type_;
     uint32_t layer_idx_ = 0;
     std::map<hwc2_layer_t, HwcLayer> layers_;
+    // Set when layers come or go, or the display config changes
+    bool layers_changed_ = true;
     HwcLayer client_layer_;
+    // Whether the last presented frame had a client target
+    bool client_target_presented_ = false;
     UniqueFd retire_fence_;
     UniqueFd next_retire_fence_;
     int32_t color_mode_;
@@ -215,12 +274,12 @@ class DrmHwcTwo : public hwc2_device_t {
     uint32_t frame_no_ = 0;
   };
 
-  class DrmHotplugHandler : public DrmEventHandler {
+  class DrmHotplugHandler : public DrmHotplugEventHandler {
    public:
     DrmHotplugHandler(DrmHwcTwo *hwc2, DrmDevice *drm)
         : hwc2_(hwc2), drm_(drm) {
     }
-    void HandleEvent(uint64_t timestamp_us);
+    void HandleHotplug(const DrmHotplugEvent &event);
 
    private:
     DrmHwcTwo *hwc2_;
@@ -283,5 +342,7 @@ class DrmHwcTwo : public hwc2_device_t {
   ResourceManager resource_manager_;
   std::map<hwc2_display_t, HwcDisplay> displays_;
   std::map<HWC2::Callback, HwcCallback> callbacks_;
+
+  std::string dump_string_;
 };
 }
@@ -17,9 +17,12 @@
 #define LOG_TAG "hwc-drm-plane"
 
 #include "drmdevice.h"
+#include "drmhwcomposer.h"
 #include "drmplane.h"
 
+#include <algorithm>
 #include <cinttypes>
+#include <drm/drm_fourcc.h>
 #include <errno.h>
 #include <stdint.h>
 
@@ -30,6 +33,8 @@ namespace android {
 
 DrmPlane::DrmPlane(DrmDevice *drm, drmModePlanePtr p)
     : drm_(drm), id_(p->plane_id), possible_crtc_mask_(p->possible_crtcs) {
+  // Legacy format list, replaced by IN_FORMATS in Init() when available
+  formats_.SetLinearFormats(p->formats, p->count_formats);
 }
 
 int DrmPlane::Init() {
@@ -119,8 +124,24 @@ int DrmPlane::Init() {
   }
 
   ret = drm_->GetPlaneProperty(*this, "rotation", &rotation_property_);
-  if (ret)
+  if (ret) {
     ALOGE("Could not get rotation property");
+  } else {
+    static const std::pair<const char *, uint32_t> kRotations[] = {
+        {"rotate-90", DrmHwcTransform::kRotate90},
+        {"rotate-180", DrmHwcTransform::kRotate180},
+        {"rotate-270", DrmHwcTransform::kRotate270},
+        {"reflect-x", DrmHwcTransform::kFlipH},
+        {"reflect-y", DrmHwcTransform::kFlipV},
+    };
+    for (auto &rotation : kRotations) {
+      int err;
+      std::tie(err, std::ignore) =
+          rotation_property_.GetEnumValueWithName(rotation.first);
+      if (!err)
+        supported_transforms_ |= rotation.second;
+    }
+  }
 
   ret = drm_->GetPlaneProperty(*this, "alpha", &alpha_property_);
   if (ret)
@@ -130,9 +151,30 @@ int DrmPlane::Init() {
   if (ret)
     ALOGI("Could not get IN_FENCE_FD property");
 
+  uint64_t in_formats_blob_id = 0;
+  ret = drm_->GetPlaneProperty(*this, "IN_FORMATS", &p);
+  if (!ret)
+    ret = p.value(&in_formats_blob_id);
+  if (!ret && in_formats_blob_id)
+    ret = ParseInFormats(in_formats_blob_id);
+  if (ret)
+    ALOGI("Could not get IN_FORMATS, using the legacy format list");
+
   return 0;
 }
 
+int DrmPlane::ParseInFormats(uint64_t blob_id) {
+  drmModePropertyBlobPtr blob = drmModeGetPropertyBlob(drm_->fd(), blob_id);
+  if (!blob)
+    return -ENOENT;
+
+  int ret = formats_.ParseInFormats(blob->data, blob->length);
+  if (ret)
+    ALOGE("Malformed IN_FORMATS blob on plane %d", id_);
+  drmModeFreePropertyBlob(blob);
+  return ret;
+}
+
 uint32_t DrmPlane::id() const {
   return id_;
 }
@@ -145,6 +187,23 @@ uint32_t DrmPlane::type() const {
   return type_;
 }
 
+bool DrmPlane::SupportsFormat(uint32_t fourcc, uint64_t modifier) const {
+  return formats_.Supports(fourcc, modifier);
+}
+
+bool DrmPlane::SupportsTransform(uint32_t transform) const {
+  return !(transform & ~supported_transforms_);
+}
+
+bool DrmPlane::SupportsAlpha() const {
+  return alpha_property_.id() != 0;
+}
+
+bool DrmPlane::SupportsScaling() const {
+  // KMS has no way to query scaling support, but cursor planes never scale
+  return type_ != DRM_PLANE_TYPE_CURSOR;
+}
+
 const DrmProperty &DrmPlane::crtc_property() const {
   return crtc_property_;
 }
@@ -18,10 +18,12 @@
 #define ANDROID_DRM_PLANE_H_
 
 #include "drmcrtc.h"
+#include "drmformattable.h"
 #include "drmproperty.h"
 
 #include <stdint.h>
 #include <xf86drmMode.h>
+#include <utility>
 #include <vector>
 
 namespace android {
@@ -42,6 +44,14 @@ class DrmPlane {
 
   uint32_t type() const;
 
+  // Whether the plane can scan out fourcc buffers laid out as modifier.
+  // DRM_FORMAT_MOD_INVALID matches any modifier supported with fourcc.
+  bool SupportsFormat(uint32_t fourcc, uint64_t modifier) const;
+  // transform is a combination of DrmHwcTransform flags
+  bool SupportsTransform(uint32_t transform) const;
+  bool SupportsAlpha() const;
+  bool SupportsScaling() const;
+
   const DrmProperty &crtc_property() const;
   const DrmProperty &fb_property() const;
   const DrmProperty &crtc_x_property() const;
@@ -57,6 +67,8 @@ class DrmPlane {
   const DrmProperty &in_fence_fd_property() const;
 
  private:
+  int ParseInFormats(uint64_t blob_id);
+
   DrmDevice *drm_;
   uint32_t id_;
 
@@ -77,6 +89,11 @@ class DrmPlane {
   DrmProperty rotation_property_;
   DrmProperty alpha_property_;
   DrmProperty in_fence_fd_property_;
+
+  // DrmHwcTransform flags the rotation property can express
+  uint32_t supported_transforms_ = 0;
+
+  DrmFormatTable formats_;
 };
 }
 
@@ -20,6 +20,7 @@
 #include <errno.h>
 #include <stdint.h>
 #include <string>
+#include <tuple>
 
 #include <xf86drmMode.h>
 
@@ -43,6 +44,10 @@ void DrmProperty::Init(drmModePropertyPtr p, uint64_t value) {
   name_ = p->name;
   value_ = value;
 
+  // Init may be called again to refresh the property
+  values_.clear();
+  enums_.clear();
+  blob_ids_.clear();
   for (int i = 0; i < p->count_values; ++i)
     values_.push_back(p->values[i]);
 
@@ -99,4 +104,13 @@ int DrmProperty::value(uint64_t *value) const {
       return -EINVAL;
   }
 }
+
+std::tuple<int, uint64_t> DrmProperty::GetEnumValueWithName(
+    const std::string &name) const {
+  for (const DrmPropertyEnum &e : enums_)
+    if (e.name_ == name)
+      return std::make_tuple(0, e.value_);
+
+  return std::make_tuple(-EINVAL, 0);
+}
 }
@@ -19,6 +19,7 @@
 
 #include <stdint.h>
 #include <string>
+#include <tuple>
 #include <xf86drmMode.h>
 #include <vector>
 
@@ -45,6 +46,7 @@ class DrmProperty {
   std::string name() const;
 
   int value(uint64_t *value) const;
+  std::tuple<int, uint64_t> GetEnumValueWithName(const std::string &name) const;
 
  private:
   class DrmPropertyEnum {
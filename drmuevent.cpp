@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "drmuevent.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+
+namespace android {
+
+void ParseDrmUEvent(const char *buffer, size_t size, DrmUEvent *uevent) {
+  bool drm_minor = false, hotplug = false;
+  bool header = true;
+  size_t i = 0;
+  while (i < size) {
+    const char *end = (const char *)memchr(buffer + i, '\0', size - i);
+    size_t length = end ? end - (buffer + i) : size - i;
+    // Copied, so the values below are terminated
+    std::string key(buffer + i, length);
+    i += length + 1;
+
+    // The first string is the action@devpath header, the rest are KEY=value
+    if (header) {
+      header = false;
+      continue;
+    }
+
+    if (key == "DEVTYPE=drm_minor")
+      drm_minor = true;
+    else if (key == "HOTPLUG=1")
+      hotplug = true;
+    else if (!key.compare(0, 6, "MINOR="))
+      uevent->minor = strtol(key.c_str() + 6, NULL, 10);
+    else if (!key.compare(0, 10, "CONNECTOR="))
+      uevent->connector_id = strtoul(key.c_str() + 10, NULL, 10);
+    else if (!key.compare(0, 9, "PROPERTY="))
+      uevent->property_id = strtoul(key.c_str() + 9, NULL, 10);
+  }
+  uevent->drm_hotplug = drm_minor && hotplug;
+}
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_DRM_UEVENT_H_
+#define ANDROID_DRM_UEVENT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace android {
+
+// The keys of a kernel uevent the hotplug handling cares about
+struct DrmUEvent {
+  // DEVTYPE=drm_minor and HOTPLUG=1 were both given
+  bool drm_hotplug = false;
+  // Minor number of the device, or -1 if not given
+  int minor = -1;
+  // 0 if not given
+  uint32_t connector_id = 0;
+  uint32_t property_id = 0;
+};
+
+// Parses the size bytes of a uevent as read off the netlink socket: an
+// action@devpath header followed by NUL separated KEY=value strings. Never
+// reads past size, the last string need not be NUL terminated.
+void ParseDrmUEvent(const char *buffer, size_t size, DrmUEvent *uevent);
+}
+
+#endif  // ANDROID_DRM_UEVENT_H_
@@ -20,25 +20,28 @@
 #include "drmhwcomposer.h"
 #include "platform.h"
 
+#include <sys/stat.h>
+
 #include <log/log.h>
 #include <ui/GraphicBufferMapper.h>
 
 namespace android {
 
+DrmHwcBuffer::Import::~Import() {
+  importer->ReleaseBuffer(&bo);
+}
+
 const hwc_drm_bo *DrmHwcBuffer::operator->() const {
-  if (importer_ == NULL) {
+  if (import_ == NULL) {
     ALOGE("Access of non-existent BO");
     exit(1);
     return NULL;
   }
-  return &bo_;
+  return &import_->bo;
 }
 
 void DrmHwcBuffer::Clear() {
-  if (importer_ != NULL) {
-    importer_->ReleaseBuffer(&bo_);
-    importer_ = NULL;
-  }
+  import_.reset();
 }
 
 int DrmHwcBuffer::ImportBuffer(buffer_handle_t handle, Importer *importer) {
@@ -48,13 +51,7 @@ int DrmHwcBuffer::ImportBuffer(buffer_handle_t handle, Importer *importer) {
   if (ret)
     return ret;
 
-  if (importer_ != NULL) {
-    importer_->ReleaseBuffer(&bo_);
-  }
-
-  importer_ = importer;
-
-  bo_ = tmp_bo;
+  import_ = std::make_shared<Import>(tmp_bo, importer);
 
   return 0;
 }
@@ -99,18 +96,81 @@ void DrmHwcNativeHandle::Clear() {
   }
 }
 
-int DrmHwcLayer::ImportBuffer(Importer *importer) {
+static int GetBufferId(buffer_handle_t handle, std::pair<dev_t, ino_t> *id) {
+  if (handle->numFds < 1)
+    return -EINVAL;
+
+  struct stat st;
+  if (fstat(handle->data[0], &st))
+    return -errno;
+
+  *id = std::make_pair(st.st_dev, st.st_ino);
+  return 0;
+}
+
+std::shared_ptr<DrmHwcNativeHandle> DrmHwcNativeHandleCache::Get(
+    buffer_handle_t handle) {
+  std::pair<dev_t, ino_t> id;
+  if (GetBufferId(handle, &id))
+    return NULL;
+
+  for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+    if (it->handle != handle)
+      continue;
+
+    if (it->id != id) {
+      // Same address, different buffer: the old one is gone
+      entries_.erase(it);
+      return NULL;
+    }
+
+    entries_.splice(entries_.begin(), entries_, it);
+    return it->copy;
+  }
+  return NULL;
+}
+
+void DrmHwcNativeHandleCache::Put(buffer_handle_t handle,
+                                  std::shared_ptr<DrmHwcNativeHandle> copy) {
+  Entry entry;
+  if (GetBufferId(handle, &entry.id))
+    return;
+
+  entries_.remove_if([handle](const Entry &e) { return e.handle == handle; });
+
+  entry.handle = handle;
+  entry.copy = copy;
+  entries_.push_front(entry);
+  if (entries_.size() > kMaxEntries)
+    entries_.pop_back();
+}
+
+int DrmHwcLayer::ImportBuffer(Importer *importer,
+                              DrmHwcNativeHandleCache *handle_cache) {
   int ret = buffer.ImportBuffer(sf_handle, importer);
   if (ret)
     return ret;
 
+  return ImportHandle(handle_cache);
+}
+
+int DrmHwcLayer::ImportHandle(DrmHwcNativeHandleCache *handle_cache) {
   const hwc_drm_bo *bo = buffer.operator->();
 
-  // FIXME: Add layerCount and a pixel stride to the hwc_drm_bo
-  ret = handle.CopyBufferHandle(sf_handle, bo->width, bo->height, 1, bo->format,
-                                bo->usage, bo->width);
-  if (ret)
-    return ret;
+  handle = handle_cache ? handle_cache->Get(sf_handle) : NULL;
+  if (!handle) {
+    handle = std::make_shared<DrmHwcNativeHandle>();
+    int ret = handle->CopyBufferHandle(sf_handle, bo->width, bo->height,
+                                       bo->layer_count, bo->hal_format,
+                                       bo->usage, bo->pixel_stride);
+    if (ret) {
+      handle.reset();
+      return ret;
+    }
+
+    if (handle_cache)
+      handle_cache->Put(sf_handle, handle);
+  }
 
   gralloc_buffer_usage = bo->usage;
 
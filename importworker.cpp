@@ -0,0 +1,191 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define ATRACE_TAG ATRACE_TAG_GRAPHICS
+#define LOG_TAG "hwc-import-worker"
+
+#include "importworker.h"
+
+#include <algorithm>
+#include <stdlib.h>
+#include <time.h>
+
+#include <cutils/properties.h>
+#include <hardware/hardware.h>
+#include <log/log.h>
+#include <utils/Trace.h>
+
+namespace android {
+
+const int64_t ImportWorker::kBucketLimitsUs[kNumBuckets - 1] = {50, 100, 250,
+                                                                 500, 1000};
+
+static int64_t GetTimestampNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 * 1000 * 1000 + ts.tv_nsec;
+}
+
+void ImportWorker::Histogram::Add(int64_t duration_ns) {
+  int64_t duration_us = duration_ns / 1000;
+  int i = 0;
+  while (i < kNumBuckets - 1 && duration_us >= kBucketLimitsUs[i])
+    i++;
+  buckets[i]++;
+}
+
+ImportWorker::ImportWorker()
+    : Worker("import", HAL_PRIORITY_URGENT_DISPLAY),
+      display_(-1),
+      enabled_(false) {
+}
+
+ImportWorker::~ImportWorker() {
+  Exit();
+}
+
+int ImportWorker::Init(std::shared_ptr<Importer> importer, int display) {
+  importer_ = importer;
+  display_ = display;
+
+  char use_import_worker_prop[PROPERTY_VALUE_MAX];
+  property_get("hwc.drm.use_import_worker", use_import_worker_prop, "1");
+  enabled_ = strtol(use_import_worker_prop, NULL, 10);
+  if (!enabled_)
+    return 0;
+
+  return InitWorker();
+}
+
+void ImportWorker::QueueImport(buffer_handle_t handle) {
+  if (!enabled_ || !handle)
+    return;
+
+  Lock();
+  if (importing_ != handle && !imported_.count(handle) &&
+      std::find(pending_.begin(), pending_.end(), handle) == pending_.end())
+    pending_.push_back(handle);
+  Unlock();
+
+  Signal();
+}
+
+int ImportWorker::TakeBuffer(buffer_handle_t handle, DrmHwcBuffer *buffer) {
+  ATRACE_CALL();
+  int64_t start = GetTimestampNs();
+
+  Lock();
+  // No point in importing it in the background anymore
+  pending_.erase(std::remove(pending_.begin(), pending_.end(), handle),
+                 pending_.end());
+  while (importing_ == handle) {
+    if (WaitForSignalOrExitLocked() == -EINTR)
+      break;
+  }
+
+  auto it = imported_.find(handle);
+  if (it == imported_.end()) {
+    Unlock();
+    Import import;
+    import.status = import.buffer.ImportBuffer(handle, importer_.get());
+    Lock();
+    ++imports_;
+    // Keep it for the other composition of this frame
+    it = imported_.emplace(handle, std::move(import)).first;
+  }
+
+  int ret = it->second.status;
+  if (!ret)
+    *buffer = it->second.buffer.Share();
+
+  critical_.Add(GetTimestampNs() - start);
+  Unlock();
+  return ret;
+}
+
+void ImportWorker::Flush() {
+  Lock();
+  pending_.clear();
+  while (importing_ != NULL) {
+    if (WaitForSignalOrExitLocked() == -EINTR)
+      break;
+  }
+  imported_.clear();
+  Unlock();
+}
+
+uint64_t ImportWorker::imports() {
+  Lock();
+  uint64_t imports = imports_;
+  Unlock();
+  return imports;
+}
+
+void ImportWorker::DumpHistogram(std::ostringstream *out, const char *name,
+                                 const Histogram &histogram) {
+  *out << "    " << name << ":";
+  for (int i = 0; i < kNumBuckets; ++i) {
+    if (i < kNumBuckets - 1)
+      *out << " <" << kBucketLimitsUs[i] << "us=";
+    else
+      *out << " >=" << kBucketLimitsUs[i - 1] << "us=";
+    *out << histogram.buckets[i];
+  }
+  *out << "\n";
+}
+
+void ImportWorker::Dump(std::ostringstream *out) {
+  Lock();
+  *out << "--ImportWorker[" << display_ << "]: enabled=" << enabled_
+       << " imports=" << imports_ << "\n";
+  DumpHistogram(out, "background imports", background_);
+  DumpHistogram(out, "composition waits", critical_);
+  Unlock();
+}
+
+void ImportWorker::Routine() {
+  Lock();
+  if (pending_.empty()) {
+    int ret = WaitForSignalOrExitLocked();
+    if (ret == -EINTR || pending_.empty()) {
+      Unlock();
+      return;
+    }
+  }
+
+  buffer_handle_t handle = pending_.front();
+  pending_.pop_front();
+  importing_ = handle;
+  Unlock();
+
+  int64_t start = GetTimestampNs();
+  Import import;
+  import.status = import.buffer.ImportBuffer(handle, importer_.get());
+  int64_t duration = GetTimestampNs() - start;
+  if (import.status)
+    ALOGE("Failed to import buffer in the background %d", import.status);
+
+  Lock();
+  background_.Add(duration);
+  ++imports_;
+  imported_[handle] = std::move(import);
+  importing_ = NULL;
+  Unlock();
+
+  // Wake up anyone waiting for this import
+  Signal();
+}
+}
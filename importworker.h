@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_IMPORT_WORKER_H_
+#define ANDROID_IMPORT_WORKER_H_
+
+#include "drmhwcomposer.h"
+#include "platform.h"
+#include "worker.h"
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <stdint.h>
+
+namespace android {
+
+// Imports the buffers SurfaceFlinger hands us into the importer while it is
+// still busy preparing the frame, so that composition only has to pick up the
+// finished imports.
+//
+// SurfaceFlinger keeps a buffer alive until after the frame that replaces it
+// has been presented, so the worker may only touch a handle until the end of
+// the present it was queued for. Flush() must be called at that point. Until
+// then every import is kept, so that the validate and present compositions
+// of a frame share a single import of each buffer.
+class ImportWorker : public Worker {
+ public:
+  ImportWorker();
+  ~ImportWorker() override;
+
+  int Init(std::shared_ptr<Importer> importer, int display);
+
+  void QueueImport(buffer_handle_t handle);
+
+  // Hands a reference to the import of handle over to buffer, importing it
+  // right away if the worker hasn't gotten to it yet
+  int TakeBuffer(buffer_handle_t handle, DrmHwcBuffer *buffer);
+
+  // Waits for the current import and drops the worker's references
+  void Flush();
+
+  // Number of buffers imported since the worker was created
+  uint64_t imports();
+
+  void Dump(std::ostringstream *out);
+
+ protected:
+  void Routine() override;
+
+ private:
+  // Import latency histogram, bucket i counts imports that took less than
+  // kBucketLimitsUs[i]. The last bucket counts everything slower.
+  static const int kNumBuckets = 6;
+  static const int64_t kBucketLimitsUs[kNumBuckets - 1];
+
+  struct Histogram {
+    uint64_t buckets[kNumBuckets] = {0};
+
+    void Add(int64_t duration_ns);
+  };
+
+  struct Import {
+    DrmHwcBuffer buffer;
+    int status = 0;
+  };
+
+  static void DumpHistogram(std::ostringstream *out, const char *name,
+                            const Histogram &histogram);
+
+  std::shared_ptr<Importer> importer_;
+  int display_;
+  bool enabled_;
+
+  std::deque<buffer_handle_t> pending_;
+  buffer_handle_t importing_ = NULL;
+  std::map<buffer_handle_t, Import> imported_;
+
+  // Time spent importing in the background, which used to be spent
+  // synchronously on the composition path
+  Histogram background_;
+  // Time the composition path still spends per layer waiting for imports
+  Histogram critical_;
+  uint64_t imports_ = 0;
+};
+}
+
+#endif
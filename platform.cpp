@@ -101,4 +101,53 @@ int PlanStageGreedy::ProvisionPlanes(
 
   return 0;
 }
+
+bool PlanStageCapable::CanDisplay(DrmPlane *plane, DrmHwcLayer *layer) {
+  const hwc_drm_bo *bo = layer->buffer.operator->();
+  if (!plane->SupportsFormat(bo->format, bo->modifiers[0]))
+    return false;
+
+  if (!plane->SupportsTransform(layer->transform))
+    return false;
+
+  if (layer->alpha != 0xffff && !plane->SupportsAlpha())
+    return false;
+
+  float src_w = layer->source_crop.right - layer->source_crop.left;
+  float src_h = layer->source_crop.bottom - layer->source_crop.top;
+  if (layer->transform & (DrmHwcTransform::kRotate90 |
+                          DrmHwcTransform::kRotate270))
+    std::swap(src_w, src_h);
+  int dst_w = layer->display_frame.right - layer->display_frame.left;
+  int dst_h = layer->display_frame.bottom - layer->display_frame.top;
+  if ((src_w != dst_w || src_h != dst_h) && !plane->SupportsScaling())
+    return false;
+
+  return true;
+}
+
+int PlanStageCapable::ProvisionPlanes(
+    std::vector<DrmCompositionPlane> *composition,
+    std::map<size_t, DrmHwcLayer *> &layers, DrmCrtc *crtc,
+    std::vector<DrmPlane *> *planes) {
+  for (auto i = layers.begin(); i != layers.end() && !planes->empty();) {
+    auto plane = std::find_if(
+        planes->begin(), planes->end(),
+        [&](DrmPlane *p) { return CanDisplay(p, i->second); });
+    if (plane == planes->end()) {
+      ALOGV("No plane can display layer %zu", i->first);
+      ++i;
+      continue;
+    }
+
+    composition->emplace_back(DrmCompositionPlane::Type::kLayer, *plane, crtc,
+                              i->first);
+    // Nothing programs zpos, so planes stack in the order they're listed. The
+    // ones skipped here are below this layer and can't take the layers above.
+    planes->erase(planes->begin(), plane + 1);
+    i = layers.erase(i);
+  }
+
+  return 0;
+}
 }
@@ -92,8 +92,8 @@ class Planner {
   // Creates a planner instance with platform-specific planning stages
   static std::unique_ptr<Planner> CreateInstance(DrmDevice *drm);
 
-  // Takes a stack of layers and provisions hardware planes for them. If the
-  // entire stack can't fit in hardware, FIXME
+  // Takes a stack of layers and provisions hardware planes for them. Layers
+  // the stages couldn't place are left in layers.
   //
   // @layers: a map of index:layer of layers to composite
   // @primary_planes: a vector of primary planes available for this frame
@@ -138,5 +138,20 @@ class PlanStageGreedy : public Planner::PlanStage {
                       std::map<size_t, DrmHwcLayer *> &layers, DrmCrtc *crtc,
                       std::vector<DrmPlane *> *planes);
 };
+
+// This plan stage places each layer, in z order, on the first remaining plane
+// whose format, transform, alpha and scaling capabilities can display it.
+// Planes are only handed out moving up the stack, the planes skipped for a
+// layer are dropped. A layer no remaining plane can display is left unplaced
+// for client composition, rather than failing a later atomic test.
+class PlanStageCapable : public Planner::PlanStage {
+ public:
+  int ProvisionPlanes(std::vector<DrmCompositionPlane> *composition,
+                      std::map<size_t, DrmHwcLayer *> &layers, DrmCrtc *crtc,
+                      std::vector<DrmPlane *> *planes);
+
+ private:
+  static bool CanDisplay(DrmPlane *plane, DrmHwcLayer *layer);
+};
 }
 #endif
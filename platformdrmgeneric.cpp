@@ -21,6 +21,7 @@
 #include "platformdrmgeneric.h"
 
 #include <drm/drm_fourcc.h>
+#include <sys/stat.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
@@ -28,6 +29,8 @@
 #include <gralloc_handle.h>
 #include <hardware/gralloc.h>
 
+#define ALIGN(value, base) (((value) + ((base)-1)) & ~((base)-1))
+
 namespace android {
 
 #ifdef USE_DRM_GENERIC_IMPORTER
@@ -51,6 +54,9 @@ DrmGenericImporter::DrmGenericImporter(DrmDevice *drm) : drm_(drm) {
 }
 
 DrmGenericImporter::~DrmGenericImporter() {
+  std::lock_guard<std::mutex> lock(cache_lock_);
+  for (auto &pair : cache_)
+    DestroyBuffer(&pair.second.bo);
 }
 
 int DrmGenericImporter::Init() {
@@ -83,59 +89,169 @@ uint32_t DrmGenericImporter::ConvertHalFormatToDrm(uint32_t hal_format) {
   }
 }
 
+uint32_t DrmGenericImporter::HalFormatBytesPerPixel(uint32_t hal_format) {
+  switch (hal_format) {
+    case HAL_PIXEL_FORMAT_RGB_888:
+      return 3;
+    case HAL_PIXEL_FORMAT_BGRA_8888:
+    case HAL_PIXEL_FORMAT_RGBX_8888:
+    case HAL_PIXEL_FORMAT_RGBA_8888:
+      return 4;
+    case HAL_PIXEL_FORMAT_RGB_565:
+      return 2;
+    default:
+      // YV12 and unknown formats, the stride is that of the first plane
+      return 1;
+  }
+}
+
 int DrmGenericImporter::ImportBuffer(buffer_handle_t handle, hwc_drm_bo_t *bo) {
   gralloc_handle_t *gr_handle = gralloc_handle(handle);
   if (!gr_handle)
     return -EINVAL;
 
+  struct stat st;
+  if (fstat(gr_handle->prime_fd, &st)) {
+    ALOGE("failed to stat prime fd %d %d", gr_handle->prime_fd, errno);
+    return -errno;
+  }
+  BufferKey key(st.st_dev, st.st_ino);
+
+  std::lock_guard<std::mutex> lock(cache_lock_);
+  auto it = cache_.find(key);
+  if (it != cache_.end()) {
+    CachedBuffer &cached = it->second;
+    lru_.splice(lru_.begin(), lru_, cached.lru_it);
+    cached.users++;
+    *bo = cached.bo;
+    return 0;
+  }
+
   uint32_t gem_handle;
-  int ret = drmPrimeFDToHandle(drm_->fd(), gr_handle->prime_fd, &gem_handle);
-  if (ret) {
-    ALOGE("failed to import prime fd %d ret=%d", gr_handle->prime_fd, ret);
+  int ret = drm_->ImportPrimeFd(gr_handle->prime_fd, &gem_handle);
+  if (ret)
     return ret;
-  }
 
   memset(bo, 0, sizeof(hwc_drm_bo_t));
   bo->width = gr_handle->width;
   bo->height = gr_handle->height;
   bo->format = ConvertHalFormatToDrm(gr_handle->format);
+  bo->hal_format = gr_handle->format;
   bo->usage = gr_handle->usage;
+  bo->pixel_stride = gr_handle->stride / HalFormatBytesPerPixel(bo->hal_format);
+  bo->layer_count = 1;
   bo->pitches[0] = gr_handle->stride;
   bo->gem_handles[0] = gem_handle;
   bo->offsets[0] = 0;
+  bo->modifiers[0] = gr_handle->modifier;
+
+  if (bo->format == DRM_FORMAT_YVU420) {
+    // Android's YV12 layout: full size Y followed by the quarter size V and U
+    // planes, with the chroma stride aligned to 16 bytes
+    uint32_t y_size = bo->pitches[0] * bo->height;
+    uint32_t c_stride = ALIGN(bo->pitches[0] / 2, 16);
+    uint32_t c_size = c_stride * bo->height / 2;
+    for (int i = 1; i < 3; i++) {
+      ret = drm_->ImportPrimeFd(gr_handle->prime_fd, &bo->gem_handles[i]);
+      if (ret) {
+        DestroyBuffer(bo);
+        return ret;
+      }
+      bo->pitches[i] = c_stride;
+      bo->offsets[i] = y_size + (i - 1) * c_size;
+      bo->modifiers[i] = gr_handle->modifier;
+    }
+  }
 
-  ret = drmModeAddFB2(drm_->fd(), bo->width, bo->height, bo->format,
-                      bo->gem_handles, bo->pitches, bo->offsets, &bo->fb_id, 0);
+  ret = drm_->CreateFramebuffer(bo);
   if (ret) {
-    ALOGE("could not create drm fb %d", ret);
+    DestroyBuffer(bo);
     return ret;
   }
 
-  return ret;
+  lru_.push_front(key);
+  CachedBuffer &cached = cache_[key];
+  cached.bo = *bo;
+  cached.users = 1;
+  cached.lru_it = lru_.begin();
+  fb_id_keys_[bo->fb_id] = key;
+
+  EvictCachedBuffersLocked();
+  return 0;
 }
 
 int DrmGenericImporter::ReleaseBuffer(hwc_drm_bo_t *bo) {
+  {
+    std::lock_guard<std::mutex> lock(cache_lock_);
+    auto key = fb_id_keys_.find(bo->fb_id);
+    if (key != fb_id_keys_.end()) {
+      auto it = cache_.find(key->second);
+      CachedBuffer &cached = it->second;
+      if (cached.users)
+        cached.users--;
+      if (!cached.users && cached.need_flush)
+        EraseCachedBufferLocked(it);
+      else
+        EvictCachedBuffersLocked();
+      return 0;
+    }
+  }
+
+  // Not one of ours, subclasses import their buffers without the cache
+  return DestroyBuffer(bo);
+}
+
+void DrmGenericImporter::FlushCache() {
+  std::lock_guard<std::mutex> lock(cache_lock_);
+  for (auto it = cache_.begin(); it != cache_.end();) {
+    auto next = std::next(it);
+    if (it->second.users)
+      it->second.need_flush = true;
+    else
+      EraseCachedBufferLocked(it);
+    it = next;
+  }
+}
+
+void DrmGenericImporter::EraseCachedBufferLocked(
+    std::map<BufferKey, CachedBuffer>::iterator it) {
+  CachedBuffer &cached = it->second;
+  fb_id_keys_.erase(cached.bo.fb_id);
+  lru_.erase(cached.lru_it);
+  DestroyBuffer(&cached.bo);
+  cache_.erase(it);
+}
+
+void DrmGenericImporter::EvictCachedBuffersLocked() {
+  // Walk from the least recently imported end and drop idle buffers until the
+  // cache is back under its limit. Buffers still held by a composition are
+  // skipped, the cache may temporarily grow past its limit because of them.
+  auto lru_it = lru_.end();
+  while (cache_.size() > kMaxCachedBuffers && lru_it != lru_.begin()) {
+    --lru_it;
+    auto it = cache_.find(*lru_it);
+    if (it->second.users)
+      continue;
+
+    auto victim = it;
+    ++lru_it;
+    EraseCachedBufferLocked(victim);
+  }
+}
+
+int DrmGenericImporter::DestroyBuffer(hwc_drm_bo_t *bo) {
   if (bo->fb_id)
     if (drmModeRmFB(drm_->fd(), bo->fb_id))
       ALOGE("Failed to rm fb");
 
-  struct drm_gem_close gem_close;
-  memset(&gem_close, 0, sizeof(gem_close));
+  // Each populated entry holds its own reference on the gem handle
   int num_gem_handles = sizeof(bo->gem_handles) / sizeof(bo->gem_handles[0]);
   for (int i = 0; i < num_gem_handles; i++) {
     if (!bo->gem_handles[i])
       continue;
 
-    gem_close.handle = bo->gem_handles[i];
-    int ret = drmIoctl(drm_->fd(), DRM_IOCTL_GEM_CLOSE, &gem_close);
-    if (ret) {
-      ALOGE("Failed to close gem handle %d %d", i, ret);
-    } else {
-      for (int j = i + 1; j < num_gem_handles; j++)
-        if (bo->gem_handles[j] == bo->gem_handles[i])
-          bo->gem_handles[j] = 0;
-      bo->gem_handles[i] = 0;
-    }
+    drm_->ReleaseGemHandle(bo->gem_handles[i]);
+    bo->gem_handles[i] = 0;
   }
   return 0;
 }
@@ -143,7 +259,7 @@ int DrmGenericImporter::ReleaseBuffer(hwc_drm_bo_t *bo) {
 #ifdef USE_DRM_GENERIC_IMPORTER
 std::unique_ptr<Planner> Planner::CreateInstance(DrmDevice *) {
   std::unique_ptr<Planner> planner(new Planner);
-  planner->AddStage<PlanStageGreedy>();
+  planner->AddStage<PlanStageCapable>();
   return planner;
 }
 #endif
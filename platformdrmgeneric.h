@@ -21,6 +21,11 @@
 #include "platform.h"
 
 #include <hardware/gralloc.h>
+#include <sys/types.h>
+
+#include <list>
+#include <map>
+#include <mutex>
 
 namespace android {
 
@@ -33,12 +38,44 @@ class DrmGenericImporter : public Importer {
 
   int ImportBuffer(buffer_handle_t handle, hwc_drm_bo_t *bo) override;
   int ReleaseBuffer(hwc_drm_bo_t *bo) override;
+  void FlushCache() override;
 
   uint32_t ConvertHalFormatToDrm(uint32_t hal_format);
+  uint32_t HalFormatBytesPerPixel(uint32_t hal_format);
+
+ protected:
+  // Removes the framebuffer and closes the gem handles of an uncached bo
+  int DestroyBuffer(hwc_drm_bo_t *bo);
+
  private:
+  // A dma-buf is identified by the inode backing its file descriptor, which
+  // stays the same no matter how many times the fd gets dup'ed or passed
+  // between processes.
+  typedef std::pair<dev_t, ino_t> BufferKey;
+
+  struct CachedBuffer {
+    hwc_drm_bo_t bo;
+    uint32_t users = 0;
+    bool need_flush = false;
+    std::list<BufferKey>::iterator lru_it;
+  };
+
+  // Keep enough framebuffers around for a triple buffered client target and
+  // a handful of triple buffered overlay layers.
+  static const size_t kMaxCachedBuffers = 32;
+
+  void EraseCachedBufferLocked(std::map<BufferKey, CachedBuffer>::iterator it);
+  void EvictCachedBuffersLocked();
+
   DrmDevice *drm_;
 
   const gralloc_module_t *gralloc_;
+
+  std::mutex cache_lock_;
+  std::map<BufferKey, CachedBuffer> cache_;
+  // Most recently imported buffers first
+  std::list<BufferKey> lru_;
+  std::map<uint32_t, BufferKey> fb_id_keys_;
 };
 }
 
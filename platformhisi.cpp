@@ -77,22 +77,23 @@ int HisiImporter::ImportBuffer(buffer_handle_t handle, hwc_drm_bo_t *bo) {
   if (!hnd)
     return -EINVAL;
 
-  uint32_t gem_handle;
-  int ret = drmPrimeFDToHandle(drm_->fd(), hnd->share_fd, &gem_handle);
-  if (ret) {
-    ALOGE("failed to import prime fd %d ret=%d", hnd->share_fd, ret);
-    return ret;
-  }
-
   int32_t fmt = ConvertHalFormatToDrm(hnd->req_format);
   if (fmt < 0)
     return fmt;
 
+  uint32_t gem_handle;
+  int ret = drm_->ImportPrimeFd(hnd->share_fd, &gem_handle);
+  if (ret)
+    return ret;
+
   memset(bo, 0, sizeof(hwc_drm_bo_t));
   bo->width = hnd->width;
   bo->height = hnd->height;
   bo->format = fmt;
+  bo->hal_format = hnd->req_format;
   bo->usage = hnd->usage;
+  bo->pixel_stride = hnd->stride;
+  bo->layer_count = 1;
 
   bo->pitches[0] = hnd->byte_stride;
   bo->gem_handles[0] = gem_handle;
@@ -109,24 +110,27 @@ int HisiImporter::ImportBuffer(buffer_handle_t handle, hwc_drm_bo_t *bo) {
       int vu_stride = MALI_ALIGN(hnd->byte_stride / 2, align);
       int v_size = vu_stride * (adjusted_height / 2);
 
-      /* V plane*/
-      bo->gem_handles[1] = gem_handle;
-      bo->pitches[1] = vu_stride;
-      bo->offsets[1] = y_size;
-      /* U plane */
-      bo->gem_handles[2] = gem_handle;
-      bo->pitches[2] = vu_stride;
-      bo->offsets[2] = y_size + v_size;
+      /* V plane, then U plane */
+      for (int i = 1; i < 3; i++) {
+        uint32_t plane_handle;
+        ret = drm_->ImportPrimeFd(hnd->share_fd, &plane_handle);
+        if (ret) {
+          DestroyBuffer(bo);
+          return ret;
+        }
+        bo->gem_handles[i] = plane_handle;
+        bo->pitches[i] = vu_stride;
+        bo->offsets[i] = y_size + (i - 1) * v_size;
+      }
       break;
     }
     default:
       break;
   }
 
-  ret = drmModeAddFB2(drm_->fd(), bo->width, bo->height, bo->format,
-                      bo->gem_handles, bo->pitches, bo->offsets, &bo->fb_id, 0);
+  ret = drm_->CreateFramebuffer(bo);
   if (ret) {
-    ALOGE("could not create drm fb %d", ret);
+    DestroyBuffer(bo);
     return ret;
   }
 
@@ -135,7 +139,7 @@ int HisiImporter::ImportBuffer(buffer_handle_t handle, hwc_drm_bo_t *bo) {
 
 std::unique_ptr<Planner> Planner::CreateInstance(DrmDevice *) {
   std::unique_ptr<Planner> planner(new Planner);
-  planner->AddStage<PlanStageGreedy>();
+  planner->AddStage<PlanStageCapable>();
   return planner;
 }
 }
@@ -75,14 +75,16 @@ uint32_t ImgImporter::ConvertImgHalFormatToDrm(IMG_native_handle_t *img_hnd, hwc
   int stride_width = ALIGN_ROUND_UP(img_hnd->iWidth, IMG_HW_ALIGN);
   uint32_t handle = -1;
 
-  int ret = drmPrimeFDToHandle(drm_->fd(), img_hnd->fd[0], &handle);
-  if (ret) {
-    ALOGE("failed to import prime fd %d ret=%d", img_hnd->fd[0], ret);
+  int ret = drm_->ImportPrimeFd(img_hnd->fd[0], &handle);
+  if (ret)
     return ret;
-  }
 
   bo->width = img_hnd->iWidth;
   bo->height = img_hnd->iHeight;
+  bo->hal_format = img_hnd->iFormat;
+  bo->usage = img_hnd->usage;
+  bo->pixel_stride = stride_width;
+  bo->layer_count = 1;
 
   switch(img_hnd->iFormat) {
   case HAL_PIXEL_FORMAT_BGRX_8888:
@@ -117,7 +119,12 @@ uint32_t ImgImporter::ConvertImgHalFormatToDrm(IMG_native_handle_t *img_hnd, hwc
     break;
   case HAL_PIXEL_FORMAT_YV12:
     bo->gem_handles[0] = handle;
-    bo->gem_handles[1] = handle;
+    ret = drm_->ImportPrimeFd(img_hnd->fd[0], &bo->gem_handles[1]);
+    if (ret) {
+      bo->gem_handles[1] = 0;
+      ReleaseImgBuffer(bo);
+      return ret;
+    }
     bo->pitches[0] = stride_width;
     bo->pitches[1] = stride_width;
     bo->offsets[1] = bo->pitches[0] * img_hnd->iHeight;
@@ -125,6 +132,7 @@ uint32_t ImgImporter::ConvertImgHalFormatToDrm(IMG_native_handle_t *img_hnd, hwc
     break;
   default:
 	ALOGE("Failed to convert format 0x%x", img_hnd->iFormat);
+    drm_->ReleaseGemHandle(handle);
     bo->format = -1;
 	return -EINVAL;
   }
@@ -177,10 +185,9 @@ int ImgImporter::ImportBuffer(buffer_handle_t ghandle, hwc_drm_bo_t *bo) {
     return ret;
   }
 
-  ret = drmModeAddFB2(drm_->fd(), bo->width, bo->height, bo->format, bo->gem_handles, bo->pitches, bo->offsets, &bo->fb_id, 0);
-
+  ret = drm_->CreateFramebuffer(bo);
   if (ret) {
-    ALOGE("could not create drm fb %d", ret);
+    ReleaseImgBuffer(bo);
     return ret;
   }
 
@@ -232,19 +239,13 @@ int ImgImporter::ReleaseImgBuffer(hwc_drm_bo_t* bo) {
     if (drmModeRmFB(drm_->fd(), bo->fb_id))
       ALOGE("Failed to rm fb %d", bo->fb_id);
   }
-  struct drm_gem_close gem_close;
-  memset(&gem_close, 0, sizeof(gem_close));
   int num_gem_handles = sizeof(bo->gem_handles) / sizeof(bo->gem_handles[0]);
   for (int i = 0; i < num_gem_handles; i++) {
     if (!bo->gem_handles[i])
       continue;
 
-    gem_close.handle = bo->gem_handles[i];
-    int ret = drmIoctl(drm_->fd(), DRM_IOCTL_GEM_CLOSE, &gem_close);
-    if (ret)
-      ALOGE("Failed to close gem handle %d %d", i, ret);
-    else
-      bo->gem_handles[i] = 0;
+    drm_->ReleaseGemHandle(bo->gem_handles[i]);
+    bo->gem_handles[i] = 0;
   }
 
   return 0;
@@ -253,7 +254,7 @@ int ImgImporter::ReleaseImgBuffer(hwc_drm_bo_t* bo) {
 #ifdef USE_IMG_IMPORTER
 std::unique_ptr<Planner> Planner::CreateInstance(DrmDevice *) {
   std::unique_ptr<Planner> planner(new Planner);
-  planner->AddStage<PlanStageGreedy>();
+  planner->AddStage<PlanStageCapable>();
   return planner;
 }
 #endif
@@ -16,7 +16,7 @@
 
 #define LOG_TAG "hwc-platform-drm-minigbm"
 
-#include "drmresources.h"
+#include "drmdevice.h"
 #include "platform.h"
 #include "platformminigbm.h"
 
@@ -31,7 +31,7 @@
 
 namespace android {
 
-Importer *Importer::CreateInstance(DrmResources *drm) {
+Importer *Importer::CreateInstance(DrmDevice *drm) {
   DrmMinigbmImporter *importer = new DrmMinigbmImporter(drm);
   if (!importer)
     return NULL;
@@ -45,7 +45,7 @@ Importer *Importer::CreateInstance(DrmResources *drm) {
   return importer;
 }
 
-DrmMinigbmImporter::DrmMinigbmImporter(DrmResources *drm) : DrmGenericImporter(drm), drm_(drm) {
+DrmMinigbmImporter::DrmMinigbmImporter(DrmDevice *drm) : DrmGenericImporter(drm), drm_(drm) {
 }
 
 DrmMinigbmImporter::~DrmMinigbmImporter() {
@@ -71,35 +71,42 @@ int DrmMinigbmImporter::ImportBuffer(buffer_handle_t handle, hwc_drm_bo_t *bo) {
   if (!gr_handle)
     return -EINVAL;
 
-  uint32_t gem_handle;
-  int ret = drmPrimeFDToHandle(drm_->fd(), gr_handle->fds[0], &gem_handle);
-  if (ret) {
-    ALOGE("failed to import prime fd %d ret=%d", gr_handle->fds[0], ret);
-    return ret;
-  }
-
   memset(bo, 0, sizeof(hwc_drm_bo_t));
   bo->width = gr_handle->width;
   bo->height = gr_handle->height;
   bo->format = gr_handle->format;
+  bo->hal_format = gr_handle->droid_format;
   bo->usage = gr_handle->usage;
-  bo->pitches[0] = gr_handle->strides[0];
-  bo->offsets[0] = gr_handle->offsets[0];
-  bo->gem_handles[0] = gem_handle;
+  bo->pixel_stride = gr_handle->pixel_stride;
+  bo->layer_count = 1;
+
+  int ret = 0;
+  int num_planes = std::min(gr_handle->base.numFds, DRV_MAX_PLANES);
+  for (int i = 0; i < num_planes; i++) {
+    ret = drm_->ImportPrimeFd(gr_handle->fds[i], &bo->gem_handles[i]);
+    if (ret) {
+      DestroyBuffer(bo);
+      return ret;
+    }
+    bo->pitches[i] = gr_handle->strides[i];
+    bo->offsets[i] = gr_handle->offsets[i];
+    bo->modifiers[i] =
+        ((uint64_t)gr_handle->format_modifiers[2 * i] << 32) |
+        gr_handle->format_modifiers[2 * i + 1];
+  }
 
-  ret = drmModeAddFB2(drm_->fd(), bo->width, bo->height, bo->format,
-                      bo->gem_handles, bo->pitches, bo->offsets, &bo->fb_id, 0);
+  ret = drm_->CreateFramebuffer(bo);
   if (ret) {
-    ALOGE("could not create drm fb %d", ret);
+    DestroyBuffer(bo);
     return ret;
   }
 
   return ret;
 }
 
-std::unique_ptr<Planner> Planner::CreateInstance(DrmResources *) {
+std::unique_ptr<Planner> Planner::CreateInstance(DrmDevice *) {
   std::unique_ptr<Planner> planner(new Planner);
-  planner->AddStage<PlanStageGreedy>();
+  planner->AddStage<PlanStageCapable>();
   return planner;
 }
 
@@ -18,10 +18,15 @@
 
 #include "resourcemanager.h"
 
-#include <cutils/properties.h>
-#include <log/log.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
 #include <sstream>
 #include <string>
+#include <thread>
+
+#include <cutils/properties.h>
+#include <log/log.h>
 
 namespace android {
 
@@ -33,31 +38,78 @@ int ResourceManager::Init() {
   // Could be a valid path or it can have at the end of it the wildcard %
   // which means that it will try open all devices until an error is met.
   int path_len = property_get("hwc.drm.device", path_pattern, "/dev/dri/card0");
-  int ret = 0;
+  std::vector<ProbedDevice> devices;
   if (path_pattern[path_len - 1] != '%') {
-    ret = AddDrmDevice(std::string(path_pattern));
+    devices.emplace_back();
+    devices.back().path = path_pattern;
   } else {
     path_pattern[path_len - 1] = '\0';
-    for (int idx = 0; !ret; ++idx) {
+    for (int idx = 0;; ++idx) {
       std::ostringstream path;
       path << path_pattern << idx;
-      ret = AddDrmDevice(path.str());
+      if (access(path.str().c_str(), F_OK))
+        break;
+      devices.emplace_back();
+      devices.back().path = path.str();
     }
   }
 
+  ProbeDrmDevices(&devices);
+
+  int ret = event_listener_.Init();
+  if (ret) {
+    ALOGE("Can't initialize event listener %d", ret);
+    return ret;
+  }
+
+  // Merge in path order, so display numbering doesn't depend on which probe
+  // finished first
+  ret = -ENODEV;
+  for (ProbedDevice &device : devices) {
+    if (device.status) {
+      ALOGE("Failed to probe %s %d", device.path.c_str(), device.status);
+      ret = device.status;
+      continue;
+    }
+    ret = AddDrmDevice(&device);
+    if (ret)
+      ALOGE("Failed to add %s %d", device.path.c_str(), ret);
+  }
+
   if (!num_displays_) {
     ALOGE("Failed to initialize any displays");
-    return ret ? -EINVAL : ret;
+    return ret ? ret : -EINVAL;
   }
 
   return hw_get_module(GRALLOC_HARDWARE_MODULE_ID,
                        (const hw_module_t **)&gralloc_);
 }
 
-int ResourceManager::AddDrmDevice(std::string path) {
-  std::unique_ptr<DrmDevice> drm = std::make_unique<DrmDevice>();
+void ResourceManager::ProbeDrmDevices(std::vector<ProbedDevice> *devices) {
+  std::atomic<size_t> next(0);
+  auto probe = [devices, &next]() {
+    for (size_t i = next++; i < devices->size(); i = next++) {
+      ProbedDevice &device = (*devices)[i];
+      device.drm = std::make_unique<DrmDevice>();
+      device.status = device.drm->Init(device.path.c_str());
+    }
+  };
+
+  // The calling thread probes too, so a single device needs no extra thread
+  size_t num_threads =
+      std::min(devices->size(), static_cast<size_t>(kMaxProbeThreads));
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < num_threads; ++i)
+    threads.emplace_back(probe);
+  probe();
+  for (std::thread &thread : threads)
+    thread.join();
+}
+
+int ResourceManager::AddDrmDevice(ProbedDevice *device) {
+  std::unique_ptr<DrmDevice> drm = std::move(device->drm);
   int displays_added, ret;
-  std::tie(ret, displays_added) = drm->Init(path.c_str(), num_displays_);
+  std::tie(ret, displays_added) = drm->AssignDisplays(num_displays_);
   if (ret)
     return ret;
   std::shared_ptr<Importer> importer;
@@ -66,6 +118,9 @@ int ResourceManager::AddDrmDevice(std::string path) {
     ALOGE("Failed to create importer instance");
     return -ENODEV;
   }
+  ret = event_listener_.AddDrmDevice(drm.get());
+  if (ret)
+    return ret;
   importers_.push_back(importer);
   drms_.push_back(std::move(drm));
   num_displays_ += displays_added;
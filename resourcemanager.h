@@ -21,6 +21,8 @@
 #include "platform.h"
 
 #include <string.h>
+#include <string>
+#include <vector>
 
 namespace android {
 
@@ -37,14 +39,29 @@ class ResourceManager {
   std::vector<std::unique_ptr<DrmDevice>> &getDrmDevices() {
     return drms_;
   }
+  DrmEventListener *event_listener() {
+    return &event_listener_;
+  }
 
  private:
-  int AddDrmDevice(std::string path);
+  // Upper bound on the number of devices probed at the same time
+  static const int kMaxProbeThreads = 4;
+
+  struct ProbedDevice {
+    std::string path;
+    std::unique_ptr<DrmDevice> drm;
+    int status = 0;
+  };
+
+  static void ProbeDrmDevices(std::vector<ProbedDevice> *devices);
+  int AddDrmDevice(ProbedDevice *device);
 
   int num_displays_;
   std::vector<std::unique_ptr<DrmDevice>> drms_;
   std::vector<std::shared_ptr<Importer>> importers_;
   const gralloc_module_t *gralloc_;
+  // Declared after drms_ so the loop is stopped before the devices go away
+  DrmEventListener event_listener_;
 };
 }
 
@@ -3,13 +3,17 @@ LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES := \
+	drmformattable_test.cpp \
+	drmuevent_test.cpp \
+	importworker_test.cpp \
+	vsyncmodel_test.cpp \
 	worker_test.cpp
 
 LOCAL_MODULE := hwc-drm-tests
 LOCAL_VENDOR_MODULE := true
 LOCAL_HEADER_LIBRARIES := libhardware_headers
 LOCAL_STATIC_LIBRARIES := libdrmhwc_utils
-LOCAL_SHARED_LIBRARIES := hwcomposer.$(TARGET_BOARD_PLATFORM)
+LOCAL_SHARED_LIBRARIES := libdrm hwcomposer.$(TARGET_BOARD_PLATFORM)
 LOCAL_C_INCLUDES := external/drm_hwcomposer
 
 include $(BUILD_NATIVE_TEST)
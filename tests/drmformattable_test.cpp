@@ -0,0 +1,162 @@
+#include <gtest/gtest.h>
+
+#include <drm/drm_fourcc.h>
+#include <drm/drm_mode.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <vector>
+
+#include "drmformattable.h"
+
+using android::DrmFormatTable;
+
+static const uint64_t kTiled = 0x0100000000000001ULL;
+
+// Lays out an IN_FORMATS blob the way the kernel does: header, formats,
+// modifiers
+static std::vector<uint8_t> MakeBlob(
+    const std::vector<uint32_t> &formats,
+    const std::vector<struct drm_format_modifier> &modifiers) {
+  struct drm_format_modifier_blob header;
+  memset(&header, 0, sizeof(header));
+  header.version = FORMAT_BLOB_CURRENT;
+  header.count_formats = formats.size();
+  header.formats_offset = sizeof(header);
+  header.count_modifiers = modifiers.size();
+  header.modifiers_offset =
+      (header.formats_offset + formats.size() * sizeof(uint32_t) + 7) & ~7;
+
+  std::vector<uint8_t> blob(header.modifiers_offset +
+                            modifiers.size() * sizeof(modifiers[0]));
+  memcpy(blob.data(), &header, sizeof(header));
+  if (!formats.empty())
+    memcpy(blob.data() + header.formats_offset, formats.data(),
+           formats.size() * sizeof(uint32_t));
+  if (!modifiers.empty())
+    memcpy(blob.data() + header.modifiers_offset, modifiers.data(),
+           modifiers.size() * sizeof(modifiers[0]));
+  return blob;
+}
+
+static struct drm_format_modifier Modifier(uint64_t formats, uint32_t offset,
+                                           uint64_t modifier) {
+  struct drm_format_modifier m;
+  memset(&m, 0, sizeof(m));
+  m.formats = formats;
+  m.offset = offset;
+  m.modifier = modifier;
+  return m;
+}
+
+static void SetHeaderField(std::vector<uint8_t> *blob, size_t field_offset,
+                           uint32_t value) {
+  memcpy(blob->data() + field_offset, &value, sizeof(value));
+}
+
+struct DrmFormatTableTest : public testing::Test {
+  DrmFormatTable table;
+
+  virtual void SetUp() {
+    uint32_t legacy[] = {DRM_FORMAT_XRGB8888};
+    table.SetLinearFormats(legacy, 1);
+  }
+};
+
+TEST_F(DrmFormatTableTest, legacy_formats_are_linear) {
+  ASSERT_TRUE(table.Supports(DRM_FORMAT_XRGB8888, DRM_FORMAT_MOD_LINEAR));
+  ASSERT_FALSE(table.Supports(DRM_FORMAT_XRGB8888, kTiled));
+  ASSERT_FALSE(table.Supports(DRM_FORMAT_ARGB8888, DRM_FORMAT_MOD_LINEAR));
+}
+
+TEST_F(DrmFormatTableTest, parses_modifiers) {
+  std::vector<uint8_t> blob = MakeBlob(
+      {DRM_FORMAT_XRGB8888, DRM_FORMAT_ARGB8888, DRM_FORMAT_NV12},
+      {Modifier(0x7, 0, DRM_FORMAT_MOD_LINEAR), Modifier(0x2, 0, kTiled)});
+  ASSERT_EQ(0, table.ParseInFormats(blob.data(), blob.size()));
+
+  ASSERT_TRUE(table.Supports(DRM_FORMAT_NV12, DRM_FORMAT_MOD_LINEAR));
+  ASSERT_TRUE(table.Supports(DRM_FORMAT_ARGB8888, kTiled));
+  ASSERT_FALSE(table.Supports(DRM_FORMAT_XRGB8888, kTiled));
+  ASSERT_FALSE(table.Supports(DRM_FORMAT_RGB565, DRM_FORMAT_MOD_LINEAR));
+}
+
+TEST_F(DrmFormatTableTest, invalid_modifier_matches_any) {
+  std::vector<uint8_t> blob =
+      MakeBlob({DRM_FORMAT_XRGB8888, DRM_FORMAT_ARGB8888},
+               {Modifier(0x2, 0, kTiled)});
+  ASSERT_EQ(0, table.ParseInFormats(blob.data(), blob.size()));
+
+  ASSERT_TRUE(table.Supports(DRM_FORMAT_ARGB8888, DRM_FORMAT_MOD_INVALID));
+  // Listed in the formats, but with no modifier at all
+  ASSERT_FALSE(table.Supports(DRM_FORMAT_XRGB8888, DRM_FORMAT_MOD_INVALID));
+}
+
+TEST_F(DrmFormatTableTest, no_modifiers_means_linear) {
+  std::vector<uint8_t> blob = MakeBlob({DRM_FORMAT_RGB565}, {});
+  ASSERT_EQ(0, table.ParseInFormats(blob.data(), blob.size()));
+
+  ASSERT_TRUE(table.Supports(DRM_FORMAT_RGB565, DRM_FORMAT_MOD_LINEAR));
+  ASSERT_FALSE(table.Supports(DRM_FORMAT_XRGB8888, DRM_FORMAT_MOD_LINEAR));
+}
+
+TEST_F(DrmFormatTableTest, modifier_window_beyond_formats) {
+  std::vector<uint8_t> blob =
+      MakeBlob({DRM_FORMAT_XRGB8888},
+               {Modifier(~0ULL, 0xffffffc0, kTiled),
+                Modifier(~0ULL, 0, DRM_FORMAT_MOD_LINEAR)});
+  ASSERT_EQ(0, table.ParseInFormats(blob.data(), blob.size()));
+
+  ASSERT_FALSE(table.Supports(DRM_FORMAT_XRGB8888, kTiled));
+  ASSERT_TRUE(table.Supports(DRM_FORMAT_XRGB8888, DRM_FORMAT_MOD_LINEAR));
+}
+
+TEST_F(DrmFormatTableTest, rejects_truncated_blob) {
+  std::vector<uint8_t> blob = MakeBlob(
+      {DRM_FORMAT_ARGB8888}, {Modifier(0x1, 0, DRM_FORMAT_MOD_LINEAR)});
+
+  ASSERT_EQ(-EINVAL, table.ParseInFormats(blob.data(), 8));
+  ASSERT_EQ(-EINVAL, table.ParseInFormats(blob.data(), blob.size() - 1));
+  ASSERT_EQ(-EINVAL, table.ParseInFormats(NULL, 0));
+
+  // The legacy table is left alone
+  ASSERT_TRUE(table.Supports(DRM_FORMAT_XRGB8888, DRM_FORMAT_MOD_LINEAR));
+  ASSERT_FALSE(table.Supports(DRM_FORMAT_ARGB8888, DRM_FORMAT_MOD_LINEAR));
+}
+
+TEST_F(DrmFormatTableTest, rejects_overflowing_offsets) {
+  std::vector<uint8_t> blob = MakeBlob(
+      {DRM_FORMAT_ARGB8888}, {Modifier(0x1, 0, DRM_FORMAT_MOD_LINEAR)});
+  const size_t count_formats =
+      offsetof(struct drm_format_modifier_blob, count_formats);
+  const size_t formats_offset =
+      offsetof(struct drm_format_modifier_blob, formats_offset);
+  const size_t count_modifiers =
+      offsetof(struct drm_format_modifier_blob, count_modifiers);
+  const size_t modifiers_offset =
+      offsetof(struct drm_format_modifier_blob, modifiers_offset);
+
+  // offset + count * 4 wraps to a small value in 32 bits
+  std::vector<uint8_t> formats_wrap(blob);
+  SetHeaderField(&formats_wrap, formats_offset, 0xfffffff0);
+  SetHeaderField(&formats_wrap, count_formats, 0x40000008);
+  ASSERT_EQ(-EINVAL,
+            table.ParseInFormats(formats_wrap.data(), formats_wrap.size()));
+
+  std::vector<uint8_t> count_wrap(blob);
+  SetHeaderField(&count_wrap, count_formats, 0x40000001);
+  ASSERT_EQ(-EINVAL,
+            table.ParseInFormats(count_wrap.data(), count_wrap.size()));
+
+  // 24 byte modifiers: 0xaaaaaab * 24 wraps to 8 in 32 bits
+  std::vector<uint8_t> modifiers_wrap(blob);
+  SetHeaderField(&modifiers_wrap, count_modifiers, 0x0aaaaaab);
+  ASSERT_EQ(-EINVAL,
+            table.ParseInFormats(modifiers_wrap.data(), modifiers_wrap.size()));
+
+  std::vector<uint8_t> past_end(blob);
+  SetHeaderField(&past_end, modifiers_offset, blob.size() + 8);
+  ASSERT_EQ(-EINVAL, table.ParseInFormats(past_end.data(), past_end.size()));
+
+  ASSERT_TRUE(table.Supports(DRM_FORMAT_XRGB8888, DRM_FORMAT_MOD_LINEAR));
+}
@@ -0,0 +1,101 @@
+#include <gtest/gtest.h>
+
+#include <string.h>
+
+#include <string>
+
+#include "drmuevent.h"
+
+using android::DrmUEvent;
+using android::ParseDrmUEvent;
+
+// Payloads are written with '\0' separators, as the kernel sends them
+static const char kChange[] = "change@/devices/pci0000:00/0000:00:02.0/drm/card0";
+
+struct UEventCase {
+  const char *name;
+  std::string payload;
+  bool drm_hotplug;
+  int minor;
+  uint32_t connector_id;
+  uint32_t property_id;
+};
+
+static std::string Payload(const char *keys, size_t size) {
+  return std::string(kChange) + '\0' + std::string(keys, size);
+}
+
+#define PAYLOAD(keys) Payload(keys, sizeof(keys) - 1)
+
+static const UEventCase kCases[] = {
+    {"connector_property",
+     PAYLOAD("ACTION=change\0DEVTYPE=drm_minor\0HOTPLUG=1\0MINOR=0\0"
+             "CONNECTOR=77\0PROPERTY=12\0SEQNUM=2143\0"),
+     true, 0, 77, 12},
+    {"connector_only",
+     PAYLOAD("ACTION=change\0DEVTYPE=drm_minor\0HOTPLUG=1\0MINOR=1\0"
+             "CONNECTOR=77\0"),
+     true, 1, 77, 0},
+    {"no_connector",
+     PAYLOAD("ACTION=change\0DEVTYPE=drm_minor\0HOTPLUG=1\0MINOR=0\0"),
+     true, 0, 0, 0},
+    {"no_minor", PAYLOAD("DEVTYPE=drm_minor\0HOTPLUG=1\0"), true, -1, 0, 0},
+    {"not_drm_minor",
+     PAYLOAD("ACTION=change\0DEVTYPE=usb_device\0HOTPLUG=1\0MINOR=0\0"),
+     false, 0, 0, 0},
+    {"no_hotplug",
+     PAYLOAD("ACTION=change\0DEVTYPE=drm_minor\0MINOR=0\0CONNECTOR=77\0"),
+     false, 0, 77, 0},
+    {"hotplug_not_1", PAYLOAD("DEVTYPE=drm_minor\0HOTPLUG=0\0"), false, -1, 0,
+     0},
+    // The keys only count as whole strings
+    {"key_prefix",
+     PAYLOAD("DEVTYPE=drm_minor_x\0HOTPLUG=1\0XMINOR=3\0XCONNECTOR=5\0"),
+     false, -1, 0, 0},
+    // Keys in the header don't count
+    {"header_only", std::string("DEVTYPE=drm_minor"), false, -1, 0, 0},
+    {"empty", std::string(), false, -1, 0, 0},
+};
+
+class DrmUEventTest : public testing::TestWithParam<UEventCase> {};
+
+TEST_P(DrmUEventTest, parses) {
+  const UEventCase &c = GetParam();
+  DrmUEvent uevent;
+  ParseDrmUEvent(c.payload.data(), c.payload.size(), &uevent);
+
+  ASSERT_EQ(c.drm_hotplug, uevent.drm_hotplug);
+  ASSERT_EQ(c.minor, uevent.minor);
+  ASSERT_EQ(c.connector_id, uevent.connector_id);
+  ASSERT_EQ(c.property_id, uevent.property_id);
+}
+
+INSTANTIATE_TEST_CASE_P(Payloads, DrmUEventTest, testing::ValuesIn(kCases),
+                        [](const testing::TestParamInfo<UEventCase> &info) {
+                          return std::string(info.param.name);
+                        });
+
+// recv() hands over size bytes, with no terminator after the last key
+TEST(DrmUEventBoundsTest, unterminated_at_size) {
+  std::string payload =
+      PAYLOAD("DEVTYPE=drm_minor\0HOTPLUG=1\0CONNECTOR=77\0PROPERTY=12");
+  std::string padded = payload + "345\0CONNECTOR=9";
+
+  DrmUEvent uevent;
+  ParseDrmUEvent(padded.data(), payload.size(), &uevent);
+  ASSERT_TRUE(uevent.drm_hotplug);
+  ASSERT_EQ(77u, uevent.connector_id);
+  ASSERT_EQ(12u, uevent.property_id);
+
+  // Cut in the middle of a key
+  DrmUEvent cut;
+  ParseDrmUEvent(padded.data(), strlen(kChange) + 1 + strlen("DEVTYPE=drm"),
+                 &cut);
+  ASSERT_FALSE(cut.drm_hotplug);
+
+  // Cut in the middle of the header
+  DrmUEvent header;
+  ParseDrmUEvent(padded.data(), 6, &header);
+  ASSERT_FALSE(header.drm_hotplug);
+  ASSERT_EQ(-1, header.minor);
+}
@@ -0,0 +1,109 @@
+#include <gtest/gtest.h>
+
+#include <map>
+#include <mutex>
+
+#include "importworker.h"
+
+using android::DrmHwcBuffer;
+using android::ImportWorker;
+using android::Importer;
+
+// Hands out made up buffer objects and counts imports per handle
+struct FakeImporter : public Importer {
+  int ImportBuffer(buffer_handle_t handle, hwc_drm_bo_t *bo) override {
+    std::lock_guard<std::mutex> guard(lock);
+    memset(bo, 0, sizeof(*bo));
+    bo->fb_id = ++imports[handle];
+    ++live;
+    return 0;
+  }
+
+  int ReleaseBuffer(hwc_drm_bo_t * /* bo */) override {
+    std::lock_guard<std::mutex> guard(lock);
+    --live;
+    return 0;
+  }
+
+  int ImportCount(buffer_handle_t handle) {
+    std::lock_guard<std::mutex> guard(lock);
+    return imports[handle];
+  }
+
+  int LiveCount() {
+    std::lock_guard<std::mutex> guard(lock);
+    return live;
+  }
+
+  std::mutex lock;
+  std::map<buffer_handle_t, int> imports;
+  int live = 0;
+};
+
+struct ImportWorkerTest : public testing::Test {
+  std::shared_ptr<FakeImporter> importer;
+  ImportWorker worker;
+  native_handle_t handles[3];
+
+  virtual void SetUp() {
+    importer = std::make_shared<FakeImporter>();
+    ASSERT_EQ(0, worker.Init(importer, 0));
+  }
+
+  // Validate and present each take every buffer of the frame
+  void TakeFrame(buffer_handle_t *frame, size_t count) {
+    for (int pass = 0; pass < 2; pass++) {
+      for (size_t i = 0; i < count; i++) {
+        DrmHwcBuffer buffer;
+        ASSERT_EQ(0, worker.TakeBuffer(frame[i], &buffer));
+        ASSERT_TRUE(buffer);
+      }
+    }
+  }
+};
+
+TEST_F(ImportWorkerTest, queued_imports_once_per_frame) {
+  buffer_handle_t frame[] = {&handles[0], &handles[1]};
+  for (buffer_handle_t handle : frame)
+    worker.QueueImport(handle);
+
+  TakeFrame(frame, 2);
+  worker.Flush();
+
+  for (buffer_handle_t handle : frame)
+    ASSERT_EQ(1, importer->ImportCount(handle));
+  ASSERT_EQ(2u, worker.imports());
+  ASSERT_EQ(0, importer->LiveCount());
+}
+
+TEST_F(ImportWorkerTest, unqueued_imports_once_per_frame) {
+  // e.g. the client target, which validate takes before it's queued
+  buffer_handle_t frame[] = {&handles[2]};
+  TakeFrame(frame, 1);
+  worker.QueueImport(frame[0]);
+  TakeFrame(frame, 1);
+  worker.Flush();
+
+  ASSERT_EQ(1, importer->ImportCount(frame[0]));
+  ASSERT_EQ(0, importer->LiveCount());
+}
+
+TEST_F(ImportWorkerTest, references_outlive_flush) {
+  worker.QueueImport(&handles[0]);
+  DrmHwcBuffer validate, present;
+  ASSERT_EQ(0, worker.TakeBuffer(&handles[0], &validate));
+  ASSERT_EQ(0, worker.TakeBuffer(&handles[0], &present));
+  ASSERT_EQ(validate->fb_id, present->fb_id);
+
+  worker.Flush();
+  validate.Clear();
+  // A queued composition still scans it out
+  ASSERT_EQ(1, importer->LiveCount());
+  present.Clear();
+  ASSERT_EQ(0, importer->LiveCount());
+
+  // Next frame, same buffer: imported anew
+  worker.QueueImport(&handles[0]);
+  ASSERT_EQ(0, worker.TakeBuffer(&handles[0], &present));
+  ASSERT_EQ(2, importer->ImportCount(&handles[0]));
+}
@@ -0,0 +1,111 @@
+#include <gtest/gtest.h>
+
+#include "vsyncmodel.h"
+
+using android::VsyncModel;
+
+static const int64_t kPeriodNs = 16666667;
+static const int64_t kStartNs = 1000000000;
+
+struct VsyncModelTest : public testing::Test {
+  VsyncModel model;
+
+  virtual void SetUp() {
+    model.SetNominalPeriodNs(kPeriodNs);
+  }
+};
+
+TEST_F(VsyncModelTest, nominal_until_fed) {
+  ASSERT_EQ(kPeriodNs, model.PeriodNs());
+  ASSERT_EQ(kStartNs + kPeriodNs, model.PredictNextVsync(kStartNs));
+}
+
+TEST_F(VsyncModelTest, learns_period) {
+  // Slightly slower than the mode says, with a bit of jitter
+  const int64_t period = 16700000;
+  for (int i = 0; i < 32; i++) {
+    int64_t jitter = (i % 3 - 1) * 50000;
+    ASSERT_TRUE(model.AddTimestamp(kStartNs + i * period + jitter));
+  }
+
+  ASSERT_NEAR(period, model.PeriodNs(), 10000);
+
+  int64_t now = kStartNs + 40 * period + 1000;
+  ASSERT_NEAR(kStartNs + 41 * period, model.PredictNextVsync(now), 200000);
+}
+
+TEST_F(VsyncModelTest, missed_vblanks) {
+  for (int i = 0; i < 8; i++)
+    ASSERT_TRUE(model.AddTimestamp(kStartNs + i * kPeriodNs));
+
+  // Skipping a couple of vblanks keeps the phase
+  ASSERT_TRUE(model.AddTimestamp(kStartNs + 11 * kPeriodNs));
+  ASSERT_NEAR(kPeriodNs, model.PeriodNs(), 1000);
+
+  int64_t now = kStartNs + 20 * kPeriodNs + kPeriodNs / 2;
+  ASSERT_NEAR(kStartNs + 21 * kPeriodNs, model.PredictNextVsync(now), 1000);
+}
+
+TEST_F(VsyncModelTest, rejects_outliers) {
+  for (int i = 0; i < 8; i++)
+    ASSERT_TRUE(model.AddTimestamp(kStartNs + i * kPeriodNs));
+
+  // Half a period off the grid
+  ASSERT_FALSE(model.AddTimestamp(kStartNs + 8 * kPeriodNs + kPeriodNs / 2));
+  ASSERT_TRUE(model.AddTimestamp(kStartNs + 9 * kPeriodNs));
+  ASSERT_NEAR(kPeriodNs, model.PeriodNs(), 1000);
+}
+
+TEST_F(VsyncModelTest, resyncs_after_phase_shift) {
+  for (int i = 0; i < 8; i++)
+    ASSERT_TRUE(model.AddTimestamp(kStartNs + i * kPeriodNs));
+
+  // The display moved by half a period, e.g. after a modeset
+  const int64_t shifted = kStartNs + kPeriodNs / 2;
+  bool accepted = false;
+  for (int i = 10; i < 20; i++)
+    accepted = model.AddTimestamp(shifted + i * kPeriodNs);
+  ASSERT_TRUE(accepted);
+
+  int64_t now = shifted + 30 * kPeriodNs + 1000;
+  ASSERT_NEAR(shifted + 31 * kPeriodNs, model.PredictNextVsync(now), 1000);
+}
+
+TEST_F(VsyncModelTest, prediction_is_continuous) {
+  for (int i = 0; i < 16; i++)
+    ASSERT_TRUE(model.AddTimestamp(kStartNs + i * kPeriodNs));
+
+  // Feeding predictions back in, as synthetic vblanks would, stays on the grid
+  int64_t now = kStartNs + 15 * kPeriodNs;
+  for (int i = 16; i < 100; i++) {
+    int64_t next = model.PredictNextVsync(now);
+    ASSERT_NEAR(kStartNs + i * kPeriodNs, next, 1000);
+    now = next;
+  }
+}
+
+TEST_F(VsyncModelTest, nominal_change_resets) {
+  for (int i = 0; i < 8; i++)
+    ASSERT_TRUE(model.AddTimestamp(kStartNs + i * kPeriodNs));
+
+  model.SetNominalPeriodNs(kPeriodNs * 2);
+  ASSERT_EQ(kPeriodNs * 2, model.PeriodNs());
+  ASSERT_EQ(kStartNs + kPeriodNs * 2, model.PredictNextVsync(kStartNs));
+}
+
+TEST_F(VsyncModelTest, variable_follows_cadence) {
+  // 48-144Hz panel showing 50fps content
+  const int64_t content_period = 20000000;
+  model.SetVariableRange(6944444, 20833333);
+  for (int i = 0; i < 64; i++)
+    ASSERT_TRUE(model.AddTimestamp(kStartNs + i * content_period));
+
+  ASSERT_NEAR(content_period, model.PeriodNs(), 500000);
+
+  // Flips faster than the panel can go aren't vblanks
+  ASSERT_FALSE(model.AddTimestamp(kStartNs + 63 * content_period + 1000));
+
+  int64_t now = kStartNs + 63 * content_period + 1000;
+  ASSERT_NEAR(kStartNs + 64 * content_period, model.PredictNextVsync(now),
+              500000);
+}
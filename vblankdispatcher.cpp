@@ -0,0 +1,258 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "hwc-vblank-dispatcher"
+
+#include "vblankdispatcher.h"
+#include "drmdevice.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include <log/log.h>
+
+namespace android {
+
+static const int64_t kOneSecondNs = 1 * 1000 * 1000 * 1000;
+
+static int64_t GetTimestampNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * kOneSecondNs + ts.tv_nsec;
+}
+
+VBlankDispatcher::VBlankDispatcher(DrmDevice *drm) : drm_(drm) {
+}
+
+int VBlankDispatcher::Init() {
+  timer_fd_.Set(
+      timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC));
+  if (timer_fd_.get() < 0) {
+    ALOGE("Failed to create vblank timer %d", -errno);
+    return -errno;
+  }
+  return 0;
+}
+
+void VBlankDispatcher::RegisterCallback(
+    int display, std::shared_ptr<VsyncCallback> callback) {
+  std::lock_guard<std::mutex> lock(lock_);
+  subscribers_.push_back({display, std::move(callback), false});
+  GetDisplayStateLocked(display);
+}
+
+void VBlankDispatcher::UnregisterCallback(
+    const std::shared_ptr<VsyncCallback> &callback) {
+  std::lock_guard<std::mutex> lock(lock_);
+  subscribers_.erase(
+      std::remove_if(subscribers_.begin(), subscribers_.end(),
+                     [&callback](const Subscriber &subscriber) {
+                       return subscriber.callback == callback;
+                     }),
+      subscribers_.end());
+}
+
+void VBlankDispatcher::VSyncControl(
+    const std::shared_ptr<VsyncCallback> &callback, bool enabled) {
+  std::lock_guard<std::mutex> lock(lock_);
+  for (Subscriber &subscriber : subscribers_) {
+    if (subscriber.callback != callback)
+      continue;
+
+    subscriber.enabled = enabled;
+    DisplayState *state = displays_[subscriber.display].get();
+    if (enabled && !state->pending && state->synthetic_deadline < 0)
+      RequestVBlankLocked(state);
+  }
+}
+
+bool VBlankDispatcher::HasEnabledSubscriberLocked(int display) const {
+  return std::any_of(subscribers_.begin(), subscribers_.end(),
+                     [display](const Subscriber &subscriber) {
+                       return subscriber.display == display &&
+                              subscriber.enabled;
+                     });
+}
+
+void VBlankDispatcher::UpdateNominalPeriodLocked(DisplayState *state) {
+  float refresh = 60.0f;  // Default to 60Hz refresh rate
+  DrmConnector *conn = drm_->GetConnectorForDisplay(state->display);
+  float scanout_refresh = conn ? conn->scanout_mode().v_refresh() : 0.0f;
+  if (scanout_refresh != 0.0f)
+    refresh = scanout_refresh;
+
+  state->model.SetNominalPeriodNs(kOneSecondNs / refresh);
+
+  float min_hz, max_hz;
+  if (conn && conn->vrr_active() && conn->GetRefreshRange(&min_hz, &max_hz))
+    state->model.SetVariableRange(kOneSecondNs / std::min(refresh, max_hz),
+                                  kOneSecondNs / min_hz);
+  else
+    state->model.SetVariableRange(0, 0);
+}
+
+VBlankDispatcher::DisplayState *VBlankDispatcher::GetDisplayStateLocked(
+    int display) {
+  auto it = displays_.find(display);
+  if (it != displays_.end())
+    return it->second.get();
+
+  std::unique_ptr<DisplayState> state(new DisplayState);
+  state->dispatcher = this;
+  state->display = display;
+  return (displays_[display] = std::move(state)).get();
+}
+
+int64_t VBlankDispatcher::PeriodNs(int display) {
+  std::lock_guard<std::mutex> lock(lock_);
+  DisplayState *state = GetDisplayStateLocked(display);
+  UpdateNominalPeriodLocked(state);
+  return state->model.PeriodNs();
+}
+
+int64_t VBlankDispatcher::PredictNextVsync(int display, int64_t now_ns) {
+  std::lock_guard<std::mutex> lock(lock_);
+  DisplayState *state = GetDisplayStateLocked(display);
+  UpdateNominalPeriodLocked(state);
+  return state->model.PredictNextVsync(now_ns);
+}
+
+bool VBlankDispatcher::VariableRefresh(int display) {
+  std::lock_guard<std::mutex> lock(lock_);
+  DisplayState *state = GetDisplayStateLocked(display);
+  UpdateNominalPeriodLocked(state);
+  return state->model.variable();
+}
+
+void VBlankDispatcher::RequestVBlankLocked(DisplayState *state) {
+  state->synthetic_deadline = -1;
+
+  DrmCrtc *crtc = drm_->GetCrtcForDisplay(state->display);
+  if (crtc) {
+    uint32_t high_crtc = (crtc->pipe() << DRM_VBLANK_HIGH_CRTC_SHIFT);
+
+    drmVBlank vblank;
+    memset(&vblank, 0, sizeof(vblank));
+    vblank.request.type = (drmVBlankSeqType)(
+        DRM_VBLANK_RELATIVE | DRM_VBLANK_EVENT |
+        (high_crtc & DRM_VBLANK_HIGH_CRTC_MASK));
+    vblank.request.sequence = 1;
+    vblank.request.signal = (unsigned long)state;
+    if (!drmWaitVBlank(drm_->fd(), &vblank)) {
+      state->pending = true;
+      return;
+    }
+  }
+
+  // No hardware vblanks to be had, make them up where the hardware would
+  // have had them
+  UpdateNominalPeriodLocked(state);
+  state->synthetic_deadline = state->model.PredictNextVsync(GetTimestampNs());
+  ArmTimerLocked();
+}
+
+void VBlankDispatcher::ArmTimerLocked() {
+  int64_t deadline = -1;
+  for (auto &display : displays_) {
+    int64_t display_deadline = display.second->synthetic_deadline;
+    if (display_deadline >= 0 && (deadline < 0 || display_deadline < deadline))
+      deadline = display_deadline;
+  }
+
+  // An all zero value disarms the timer
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+  if (deadline >= 0) {
+    spec.it_value.tv_sec = deadline / kOneSecondNs;
+    spec.it_value.tv_nsec = std::max<int64_t>(deadline % kOneSecondNs, 1);
+  }
+  if (timerfd_settime(timer_fd_.get(), TFD_TIMER_ABSTIME, &spec, NULL))
+    ALOGE("Failed to arm vblank timer %d", -errno);
+}
+
+void VBlankDispatcher::Dispatch(DisplayState *state, int64_t timestamp,
+                                bool synthetic) {
+  std::vector<std::shared_ptr<VsyncCallback>> callbacks;
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    if (!synthetic) {
+      UpdateNominalPeriodLocked(state);
+      state->model.AddTimestamp(timestamp);
+    }
+    for (Subscriber &subscriber : subscribers_) {
+      if (subscriber.display == state->display && subscriber.enabled)
+        callbacks.push_back(subscriber.callback);
+    }
+
+    // Queue up the next one before running the callbacks to keep the gap
+    // small
+    if (!callbacks.empty())
+      RequestVBlankLocked(state);
+  }
+
+  for (std::shared_ptr<VsyncCallback> &callback : callbacks)
+    callback->Callback(state->display, timestamp);
+}
+
+// static
+void VBlankDispatcher::HandleVBlank(unsigned int /* sequence */,
+                                    unsigned int tv_sec, unsigned int tv_usec,
+                                    void *user_data) {
+  DisplayState *state = (DisplayState *)user_data;
+  if (!state)
+    return;
+
+  {
+    std::lock_guard<std::mutex> lock(state->dispatcher->lock_);
+    state->pending = false;
+  }
+  state->dispatcher->Dispatch(
+      state, (int64_t)tv_sec * kOneSecondNs + (int64_t)tv_usec * 1000, false);
+}
+
+void VBlankDispatcher::HandleTimeout() {
+  uint64_t expirations;
+  while (read(timer_fd_.get(), &expirations, sizeof(expirations)) > 0) {
+  }
+
+  int64_t now = GetTimestampNs();
+  std::vector<std::pair<DisplayState *, int64_t>> due;
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    for (auto &display : displays_) {
+      DisplayState *state = display.second.get();
+      if (state->synthetic_deadline < 0 || state->synthetic_deadline > now)
+        continue;
+
+      due.emplace_back(state, state->synthetic_deadline);
+      state->synthetic_deadline = -1;
+      // Nobody is listening anymore, let it lapse
+      if (!HasEnabledSubscriberLocked(state->display))
+        due.pop_back();
+    }
+    ArmTimerLocked();
+  }
+
+  for (auto &vblank : due)
+    Dispatch(vblank.first, vblank.second, true);
+}
+}
@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VBLANK_DISPATCHER_H_
+#define ANDROID_VBLANK_DISPATCHER_H_
+
+#include "autofd.h"
+#include "vsyncmodel.h"
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <vector>
+
+namespace android {
+
+class DrmDevice;
+
+class VsyncCallback {
+ public:
+  virtual ~VsyncCallback() {
+  }
+  virtual void Callback(int display, int64_t timestamp) = 0;
+};
+
+// Delivers the vblanks of every display of a DrmDevice to its subscribers.
+//
+// While any subscriber of a display is enabled, a DRM_VBLANK_EVENT request is
+// kept queued for the display's crtc. The resulting event is picked up by the
+// device's DrmEventListener, which hands it to HandleVBlank(). If the kernel
+// refuses the request (e.g. the crtc is off), vblanks are synthesized from the
+// display's VsyncModel instead, so they stay in phase with the hardware. The
+// next synthetic vblank is armed on timer_fd(), which the listener also
+// watches and hands to HandleTimeout().
+//
+// Callbacks run on the event listener thread and must not block.
+class VBlankDispatcher {
+ public:
+  VBlankDispatcher(DrmDevice *drm);
+
+  int Init();
+
+  // Subscribes callback to the vblanks of display, initially disabled
+  void RegisterCallback(int display, std::shared_ptr<VsyncCallback> callback);
+  void UnregisterCallback(const std::shared_ptr<VsyncCallback> &callback);
+  void VSyncControl(const std::shared_ptr<VsyncCallback> &callback,
+                    bool enabled);
+
+  // Called by the event listener for each DRM_VBLANK_EVENT
+  static void HandleVBlank(unsigned int sequence, unsigned int tv_sec,
+                           unsigned int tv_usec, void *user_data);
+
+  int timer_fd() const {
+    return timer_fd_.get();
+  }
+  // Called by the event listener once timer_fd() fires
+  void HandleTimeout();
+
+  // Estimated vsync period of display, and the first vsync of display
+  // predicted to happen after now_ns. Both fall back to the active mode's
+  // refresh rate until enough vblanks have been seen.
+  int64_t PeriodNs(int display);
+  int64_t PredictNextVsync(int display, int64_t now_ns);
+  // Whether display currently runs at a variable refresh rate, in which case
+  // its vblanks follow the content rather than a fixed grid
+  bool VariableRefresh(int display);
+
+ private:
+  struct Subscriber {
+    int display;
+    std::shared_ptr<VsyncCallback> callback;
+    bool enabled;
+  };
+
+  struct DisplayState {
+    VBlankDispatcher *dispatcher;
+    int display;
+    // A DRM_VBLANK_EVENT request is queued in the kernel
+    bool pending = false;
+    // Time of the next synthetic vblank, or -1 while using real ones
+    int64_t synthetic_deadline = -1;
+    VsyncModel model;
+  };
+
+  void Dispatch(DisplayState *state, int64_t timestamp, bool synthetic);
+  void RequestVBlankLocked(DisplayState *state);
+  void ArmTimerLocked();
+  bool HasEnabledSubscriberLocked(int display) const;
+  DisplayState *GetDisplayStateLocked(int display);
+  void UpdateNominalPeriodLocked(DisplayState *state);
+
+  DrmDevice *drm_;
+  UniqueFd timer_fd_;
+
+  std::mutex lock_;
+  std::vector<Subscriber> subscribers_;
+  // The kernel hands DisplayState pointers back as event user data, so the
+  // states must stay put for as long as the device is open
+  std::map<int, std::unique_ptr<DisplayState>> displays_;
+};
+}
+
+#endif
@@ -0,0 +1,156 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "vsyncmodel.h"
+
+#include <math.h>
+
+namespace android {
+
+void VsyncModel::SetNominalPeriodNs(int64_t period_ns) {
+  if (period_ns <= 0 || period_ns == nominal_period_ns_)
+    return;
+
+  nominal_period_ns_ = period_ns;
+  Reset();
+}
+
+void VsyncModel::SetVariableRange(int64_t min_period_ns,
+                                  int64_t max_period_ns) {
+  if (min_period_ns == min_period_ns_ && max_period_ns == max_period_ns_)
+    return;
+
+  min_period_ns_ = min_period_ns;
+  max_period_ns_ = max_period_ns;
+  Reset();
+}
+
+void VsyncModel::Reset() {
+  samples_.clear();
+  consecutive_outliers_ = 0;
+  period_ns_ = nominal_period_ns_;
+  anchor_ns_ = -1;
+}
+
+bool VsyncModel::AddTimestamp(int64_t timestamp_ns) {
+  if (period_ns_ <= 0)
+    return false;
+  if (variable())
+    return AddVariableTimestamp(timestamp_ns);
+
+  int64_t index = 0;
+  if (!samples_.empty()) {
+    const Sample &last = samples_.back();
+    int64_t delta = timestamp_ns - last.timestamp_ns;
+    double periods = (double)delta / period_ns_;
+    int64_t whole_periods = llround(periods);
+    if (whole_periods < 1 ||
+        fabs(periods - whole_periods) > kOutlierFraction) {
+      if (++consecutive_outliers_ < kMaxConsecutiveOutliers)
+        return false;
+
+      // The display isn't where we think it is anymore, start over from here
+      Reset();
+    } else {
+      index = last.index + whole_periods;
+    }
+  }
+
+  consecutive_outliers_ = 0;
+  samples_.push_back({index, timestamp_ns});
+  if (samples_.size() > kWindowSize)
+    samples_.pop_front();
+
+  Fit();
+  return true;
+}
+
+bool VsyncModel::AddVariableTimestamp(int64_t timestamp_ns) {
+  if (anchor_ns_ >= 0) {
+    int64_t interval = timestamp_ns - anchor_ns_;
+    // Faster than the panel can go, not a real vblank
+    if (interval < min_period_ns_ / 2)
+      return false;
+
+    // Past the slowest rate the panel repeated the last frame on its own,
+    // that says nothing about the content
+    if (interval <= max_period_ns_) {
+      period_ns_ += (interval - period_ns_) / kCadenceWeight;
+      if (period_ns_ < min_period_ns_)
+        period_ns_ = min_period_ns_;
+      else if (period_ns_ > max_period_ns_)
+        period_ns_ = max_period_ns_;
+    }
+  }
+
+  anchor_ns_ = timestamp_ns;
+  return true;
+}
+
+void VsyncModel::Fit() {
+  const Sample &last = samples_.back();
+  if (samples_.size() < kMinSamples) {
+    period_ns_ = nominal_period_ns_;
+    anchor_ns_ = last.timestamp_ns;
+    return;
+  }
+
+  // Least squares fit of timestamp over index, relative to the first sample
+  // to keep the sums small
+  const Sample &first = samples_.front();
+  double n = samples_.size();
+  double sum_x = 0, sum_y = 0, sum_xx = 0, sum_xy = 0;
+  for (const Sample &sample : samples_) {
+    double x = sample.index - first.index;
+    double y = sample.timestamp_ns - first.timestamp_ns;
+    sum_x += x;
+    sum_y += y;
+    sum_xx += x * x;
+    sum_xy += x * y;
+  }
+
+  double denominator = n * sum_xx - sum_x * sum_x;
+  if (denominator <= 0) {
+    anchor_ns_ = last.timestamp_ns;
+    return;
+  }
+
+  double slope = (n * sum_xy - sum_x * sum_y) / denominator;
+  double intercept = (sum_y - slope * sum_x) / n;
+
+  // Don't let a bad window talk us into something far from the mode
+  if (slope < nominal_period_ns_ * 0.5 || slope > nominal_period_ns_ * 1.5) {
+    period_ns_ = nominal_period_ns_;
+    anchor_ns_ = last.timestamp_ns;
+    return;
+  }
+
+  period_ns_ = llround(slope);
+  anchor_ns_ = first.timestamp_ns +
+               llround(intercept + slope * (last.index - first.index));
+}
+
+int64_t VsyncModel::PredictNextVsync(int64_t now_ns) const {
+  if (period_ns_ <= 0)
+    return now_ns;
+  if (anchor_ns_ < 0)
+    return now_ns + period_ns_;
+  if (now_ns < anchor_ns_)
+    return anchor_ns_;
+
+  return anchor_ns_ + period_ns_ * ((now_ns - anchor_ns_) / period_ns_ + 1);
+}
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_VSYNC_MODEL_H_
+#define ANDROID_VSYNC_MODEL_H_
+
+#include <deque>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace android {
+
+// Estimates a display's vsync period and phase from hardware vblank
+// timestamps.
+//
+// The last kWindowSize accepted timestamps are fitted to a line over their
+// vsync index by least squares. Missed vblanks are accounted for by rounding
+// the gap to the previous timestamp to a whole number of periods, and samples
+// too far off that grid are rejected as outliers. Until enough samples have
+// been seen, the nominal period of the mode is used.
+//
+// With a variable refresh range set, vblanks follow the content instead of a
+// fixed grid. The period then tracks the recent frame cadence within the range
+// and predictions continue that cadence from the last vblank.
+class VsyncModel {
+ public:
+  VsyncModel() = default;
+
+  // Sets the period the mode is expected to have. Changing it throws away
+  // everything learned so far.
+  void SetNominalPeriodNs(int64_t period_ns);
+
+  // Adds a hardware vblank timestamp. Returns false if it was rejected as an
+  // outlier.
+  bool AddTimestamp(int64_t timestamp_ns);
+
+  // Switches to variable refresh between min_period_ns and max_period_ns, or
+  // back to a fixed one if both are 0. Changing it forgets all timestamps.
+  void SetVariableRange(int64_t min_period_ns, int64_t max_period_ns);
+  bool variable() const {
+    return max_period_ns_ > 0;
+  }
+
+  // Forgets all timestamps, keeping the nominal period
+  void Reset();
+
+  int64_t PeriodNs() const {
+    return period_ns_;
+  }
+
+  // Returns the first vsync predicted to happen after now_ns
+  int64_t PredictNextVsync(int64_t now_ns) const;
+
+ private:
+  static const size_t kWindowSize = 32;
+  static const size_t kMinSamples = 4;
+  // Samples further than this fraction of a period off the predicted grid
+  // are outliers
+  static constexpr double kOutlierFraction = 0.25;
+  // After this many outliers in a row, the model is assumed to be stale
+  static const int kMaxConsecutiveOutliers = 3;
+  // Weight of a new frame interval in the variable refresh cadence, as 1/n
+  static const int kCadenceWeight = 8;
+
+  struct Sample {
+    int64_t index;
+    int64_t timestamp_ns;
+  };
+
+  void Fit();
+  bool AddVariableTimestamp(int64_t timestamp_ns);
+
+  int64_t nominal_period_ns_ = 0;
+  int64_t min_period_ns_ = 0;
+  int64_t max_period_ns_ = 0;
+  int64_t period_ns_ = 0;
+  // Fitted time of the most recent sample
+  int64_t anchor_ns_ = -1;
+
+  std::deque<Sample> samples_;
+  int consecutive_outliers_ = 0;
+};
+}
+
+#endif